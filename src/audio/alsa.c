@@ -21,16 +21,220 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <opus_multistream.h>
 #include <alsa/asoundlib.h>
 
+// Packets the queue has to stay on target before the resampler is bypassed again
+#define RESAMPLE_IDLE_PACKETS 200
+
 #define CHECK_RETURN(f) if ((rc = f) < 0) { printf("Alsa error code %d\n", rc); return -1; }
 
 static snd_pcm_t *handle;
 static OpusMSDecoder* decoder;
 static short* pcmBuffer;
 static int samplesPerFrame;
+static int channelCount;
+static int deviceChannels;
+static short* mixBuffer;
+static bool useMmap;
+static snd_pcm_uframes_t bufferSize, startThreshold;
+static int streamRate, deviceRate;
+static bool resampling;
+static int idlePackets;
+static short* resampleBuffer;
+static int resampleFrames;
+static short* tailBuffer;
+static int tailFrames;
+
+// Remember the last frames sent to the device, so the resampler can take over without a gap
+static void alsa_renderer_keep_tail(const short* frames, int count) {
+  if (tailBuffer == NULL)
+    return;
+
+  int keep = tailFrames;
+  if (keep + count > AUDIO_RESAMPLE_TAPS)
+    keep = count >= AUDIO_RESAMPLE_TAPS ? 0 : AUDIO_RESAMPLE_TAPS - count;
+  if (count > AUDIO_RESAMPLE_TAPS) {
+    frames += (count - AUDIO_RESAMPLE_TAPS) * deviceChannels;
+    count = AUDIO_RESAMPLE_TAPS;
+  }
+
+  memmove(tailBuffer, tailBuffer + (tailFrames - keep) * deviceChannels, keep * deviceChannels * sizeof(short));
+  memcpy(tailBuffer + keep * deviceChannels, frames, count * deviceChannels * sizeof(short));
+  tailFrames = keep + count;
+}
+
+// With matching rates the resampler only comes in once the queue drifts away from its target,
+// and leaves again once the queue stayed on target for a while
+static void alsa_renderer_check_drift() {
+  if (resampleBuffer == NULL || streamRate != deviceRate)
+    return;
+
+  if (audio_core_rate_adjust() != 1.0) {
+    idlePackets = 0;
+    if (!resampling) {
+      audio_resample_prime(tailBuffer, tailFrames);
+      resampling = true;
+    }
+  } else if (resampling && ++idlePackets >= RESAMPLE_IDLE_PACKETS) {
+    resampling = false;
+    tailFrames = 0;
+  }
+}
+
+// Downmix and resample a decoded packet as needed, returns the frames ready for the device
+static short* alsa_renderer_convert(int* frames) {
+  short* output = pcmBuffer;
+  if (mixBuffer != NULL) {
+    audio_core_mix(pcmBuffer, mixBuffer, *frames);
+    output = mixBuffer;
+  }
+
+  if (resampling) {
+    *frames = audio_resample(output, *frames, resampleBuffer, resampleFrames, audio_core_rate_adjust());
+    return resampleBuffer;
+  }
+
+  alsa_renderer_keep_tail(output, *frames);
+  return output;
+}
+
+// Frames still queued in front of the speaker, for the A/V sync measurement
+static void alsa_renderer_report_delay() {
+  snd_pcm_sframes_t delay;
+  if (snd_pcm_delay(handle, &delay) == 0 && delay >= 0)
+    audio_core_device_latency((int) ((int64_t) delay * 1000000 / deviceRate));
+}
+
+static void alsa_renderer_play(char* data, int length) {
+  alsa_renderer_check_drift();
+
+  int decodeLen = audio_core_decode(decoder, data, length, pcmBuffer, samplesPerFrame);
+  if (decodeLen > 0) {
+    int frames = decodeLen;
+    short* output = alsa_renderer_convert(&frames);
+    if (frames == 0)
+      return;
+
+    int rc = snd_pcm_writei(handle, output, frames);
+    if (rc < 0) {
+      if (rc == -EPIPE)
+        audio_core_xrun();
+      rc = snd_pcm_recover(handle, rc, 0);
+      if (rc == 0)
+        rc = snd_pcm_writei(handle, output, frames);
+    }
+
+    if (rc<0)
+      printf("Alsa error from writei: %d\n", rc);
+    else if (frames != rc)
+      printf("Alsa shortm write, write %d frames\n", rc);
+    else
+      alsa_renderer_report_delay();
+  }
+}
+
+// Wait until the device ring has room for the given amount of frames
+static int alsa_renderer_wait(snd_pcm_uframes_t frames) {
+  for (;;) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+    if (avail < 0)
+      return avail;
+    if (avail >= frames)
+      return 0;
+
+    int rc = snd_pcm_wait(handle, 1000);
+    if (rc < 0)
+      return rc;
+  }
+}
+
+// Decode straight into the device ring, only a wrap around, downmix or resampling needs an extra pass
+static int alsa_renderer_mmap_write(char* data, int length, int* decodeLen) {
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, frames;
+  snd_pcm_sframes_t committed;
+  short* area;
+  int rc;
+
+  if (mixBuffer == NULL && !resampling) {
+    if ((rc = alsa_renderer_wait(samplesPerFrame)) < 0)
+      return rc;
+    frames = samplesPerFrame;
+    if ((rc = snd_pcm_mmap_begin(handle, &areas, &offset, &frames)) < 0)
+      return rc;
+
+    area = (short*) ((char*) areas[0].addr + areas[0].first / 8 + offset * areas[0].step / 8);
+    if (frames >= samplesPerFrame) {
+      *decodeLen = audio_core_decode(decoder, data, length, area, samplesPerFrame);
+      if (*decodeLen > 0)
+        alsa_renderer_keep_tail(area, *decodeLen);
+      committed = snd_pcm_mmap_commit(handle, offset, *decodeLen > 0 ? *decodeLen : 0);
+      return committed < 0 ? committed : 0;
+    }
+    snd_pcm_mmap_commit(handle, offset, 0);
+  }
+
+  *decodeLen = audio_core_decode(decoder, data, length, pcmBuffer, samplesPerFrame);
+  if (*decodeLen <= 0)
+    return 0;
+
+  int count = *decodeLen;
+  short* output = alsa_renderer_convert(&count);
+  int done = 0;
+  while (done < count) {
+    if ((rc = alsa_renderer_wait(count - done)) < 0)
+      return rc;
+    frames = count - done;
+    if ((rc = snd_pcm_mmap_begin(handle, &areas, &offset, &frames)) < 0)
+      return rc;
+
+    area = (short*) ((char*) areas[0].addr + areas[0].first / 8 + offset * areas[0].step / 8);
+    memcpy(area, output + done * deviceChannels, frames * deviceChannels * sizeof(short));
+    if ((committed = snd_pcm_mmap_commit(handle, offset, frames)) < 0)
+      return committed;
+    done += committed;
+  }
+  return 0;
+}
+
+// Writes start the stream on their own, mapped access has to do it by hand
+static int alsa_renderer_mmap_start() {
+  if (snd_pcm_state(handle) != SND_PCM_STATE_PREPARED)
+    return 0;
+
+  snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+  if (avail < 0)
+    return avail;
+  if (bufferSize - avail < startThreshold)
+    return 0;
+
+  return snd_pcm_start(handle);
+}
+
+static void alsa_renderer_mmap_play(char* data, int length) {
+  alsa_renderer_check_drift();
+
+  int decodeLen = 0;
+  int rc = alsa_renderer_mmap_write(data, length, &decodeLen);
+  if (rc < 0) {
+    if (rc == -EPIPE)
+      audio_core_xrun();
+    rc = snd_pcm_recover(handle, rc, 0);
+    // The packet is lost when the decoder already ran, replaying it would corrupt its state
+    if (rc == 0 && decodeLen == 0)
+      rc = alsa_renderer_mmap_write(data, length, &decodeLen);
+  }
+  if (rc == 0)
+    rc = alsa_renderer_mmap_start();
+
+  if (rc<0)
+    printf("Alsa error from mmap write: %d\n", rc);
+  else
+    alsa_renderer_report_delay();
+}
 
 static int alsa_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
   int rc;
@@ -49,6 +253,7 @@ static int alsa_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGUR
   }
 
   samplesPerFrame = opusConfig->samplesPerFrame;
+  channelCount = opusConfig->channelCount;
   pcmBuffer = malloc(sizeof(short) * opusConfig->channelCount * samplesPerFrame);
   if (pcmBuffer == NULL)
     return -1;
@@ -67,18 +272,43 @@ static int alsa_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGUR
 
   /* Open PCM device for playback. */
   CHECK_RETURN(snd_pcm_open(&handle, audio_device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK))
+  // Opened non-blocking so a busy device fails fast, the audio thread writes blocking
+  CHECK_RETURN(snd_pcm_nonblock(handle, 0))
 
   /* Set hardware parameters */
   CHECK_RETURN(snd_pcm_hw_params_malloc(&hw_params));
   CHECK_RETURN(snd_pcm_hw_params_any(handle, hw_params));
-  CHECK_RETURN(snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED));
+  // Not every plugin chain can be mapped, fall back to copying writes
+  useMmap = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+  if (!useMmap)
+    CHECK_RETURN(snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED));
   CHECK_RETURN(snd_pcm_hw_params_set_format(handle, hw_params, SND_PCM_FORMAT_S16_LE));
+  // Resample ourselves instead of going through the plug plugin
+  snd_pcm_hw_params_set_rate_resample(handle, hw_params, 0);
   CHECK_RETURN(snd_pcm_hw_params_set_rate_near(handle, hw_params, &sampleRate, NULL));
-  CHECK_RETURN(snd_pcm_hw_params_set_channels(handle, hw_params, opusConfig->channelCount));
+  period_size = (sampleRate * 20) / 1000;
+  buffer_size = 3 * period_size;
+  // Downmix when the sink can't take all channels of the stream
+  deviceChannels = opusConfig->channelCount;
+  while (snd_pcm_hw_params_test_channels(handle, hw_params, deviceChannels) < 0) {
+    int next = deviceChannels > 6 ? 6 : 2;
+    if (next >= deviceChannels || !audio_mix_init(opusConfig->channelCount, next))
+      break;
+    deviceChannels = next;
+  }
+  CHECK_RETURN(snd_pcm_hw_params_set_channels(handle, hw_params, deviceChannels));
+  if (deviceChannels != opusConfig->channelCount) {
+    printf("Downmixing %d audio channels to %d\n", opusConfig->channelCount, deviceChannels);
+    mixBuffer = malloc(sizeof(short) * deviceChannels * samplesPerFrame);
+    if (mixBuffer == NULL)
+      return -1;
+  }
   CHECK_RETURN(snd_pcm_hw_params_set_period_size_near(handle, hw_params, &period_size, NULL));
   CHECK_RETURN(snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &buffer_size));
   CHECK_RETURN(snd_pcm_hw_params(handle, hw_params));
   snd_pcm_hw_params_free(hw_params);
+  bufferSize = buffer_size;
+  startThreshold = period_size;
 
   /* Set software parameters */
   CHECK_RETURN(snd_pcm_sw_params_malloc(&sw_params));
@@ -90,10 +320,33 @@ static int alsa_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGUR
 
   CHECK_RETURN(snd_pcm_prepare(handle));
 
-  return 0;
+  streamRate = opusConfig->sampleRate;
+  deviceRate = sampleRate;
+  resampling = false;
+  idlePackets = 0;
+  tailFrames = 0;
+  // Playing on without it would run at the wrong rate or drift away
+  if (!audio_resample_init(deviceChannels, streamRate, deviceRate, samplesPerFrame))
+    return -1;
+  resampleFrames = audio_resample_max_frames(samplesPerFrame);
+  resampleBuffer = malloc(sizeof(short) * deviceChannels * resampleFrames);
+  tailBuffer = malloc(sizeof(short) * deviceChannels * AUDIO_RESAMPLE_TAPS);
+  if (resampleBuffer == NULL || tailBuffer == NULL) {
+    fprintf(stderr, "Not enough memory for the audio resampler\n");
+    return -1;
+  }
+
+  if (deviceRate != streamRate) {
+    printf("Resampling audio from %d Hz to %d Hz\n", streamRate, deviceRate);
+    resampling = true;
+  }
+
+  return audio_core_start(opusConfig, useMmap ? alsa_renderer_mmap_play : alsa_renderer_play);
 }
 
 static void alsa_renderer_cleanup() {
+  audio_core_stop();
+
   if (decoder != NULL) {
     opus_multistream_decoder_destroy(decoder);
     decoder = NULL;
@@ -109,30 +362,26 @@ static void alsa_renderer_cleanup() {
     free(pcmBuffer);
     pcmBuffer = NULL;
   }
-}
 
-static void alsa_renderer_decode_and_play_sample(char* data, int length) {
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, samplesPerFrame, 0);
-  if (decodeLen > 0) {
-    int rc = snd_pcm_writei(handle, pcmBuffer, decodeLen);
-    if (rc < 0) {
-      rc = snd_pcm_recover(handle, rc, 0);
-      if (rc == 0)
-        rc = snd_pcm_writei(handle, pcmBuffer, decodeLen);
-    }
+  if (mixBuffer != NULL) {
+    free(mixBuffer);
+    mixBuffer = NULL;
+  }
 
-    if (rc<0)
-      printf("Alsa error from writei: %d\n", rc);
-    else if (decodeLen != rc)
-      printf("Alsa shortm write, write %d frames\n", rc);
-  } else if (decodeLen < 0) {
-    printf("Opus error from decode: %d\n", decodeLen);
+  audio_resample_destroy();
+  if (resampleBuffer != NULL) {
+    free(resampleBuffer);
+    resampleBuffer = NULL;
+  }
+  if (tailBuffer != NULL) {
+    free(tailBuffer);
+    tailBuffer = NULL;
   }
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_alsa = {
   .init = alsa_renderer_init,
   .cleanup = alsa_renderer_cleanup,
-  .decodeAndPlaySample = alsa_renderer_decode_and_play_sample,
+  .decodeAndPlaySample = audio_core_submit,
   .capabilities = CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION,
 };
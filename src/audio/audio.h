@@ -21,10 +21,73 @@
 
 #include <Limelight.h>
 
+struct OpusMSDecoder;
+
+// Audio queue latency ceiling in ms set by -audiolatency, 0 for the default
+extern int audioLatencyCeiling;
+
+// Decodes and plays one packet on the audio thread, may block on the device
+typedef void(*Audio_Play)(char* data, int length);
+
+struct audio_stats {
+  unsigned long packets;
+  unsigned long underruns;
+  unsigned long xruns;
+  unsigned long drops;
+  unsigned long overflows;
+  unsigned long depthSum;
+  int maxDepth;
+  int targetMs;
+  unsigned long decodes;
+  unsigned long decodeUs;
+  int maxDecodeUs;
+  unsigned long mixFrames;
+  unsigned long mixNs;
+  int deviceLatencyUs;
+  int maxDeviceLatencyUs;
+  unsigned long paced;
+  unsigned long paceErrorUs;
+  int maxPaceErrorUs;
+};
+
+int audio_core_start(POPUS_MULTISTREAM_CONFIGURATION opusConfig, Audio_Play play);
+void audio_core_stop();
+void audio_core_submit(char* data, int length);
+int audio_core_decode(struct OpusMSDecoder* decoder, char* data, int length, short* pcm, int frames);
+void audio_core_mix(const short* in, short* out, int frames);
+void audio_core_xrun();
+void audio_core_device_latency(int us);
+void audio_core_pace(int frames);
+double audio_core_rate_adjust();
+void audio_core_get_stats(struct audio_stats* stats);
+void audio_core_print_stats();
+
+// Channel downmix for sinks with fewer channels than the stream, see mix.c
+// Weights set by -downmix, NULL for the built-in matrices
+extern const char* audioDownmixMatrix;
+bool audio_mix_init(int inChannels, int outChannels);
+void audio_mix(const short* in, short* out, int frames);
+
+// Polyphase resampler with drift compensation, see resample.c
+#define AUDIO_RESAMPLE_TAPS 32
+#define AUDIO_RESAMPLE_MAX_ADJUST 0.002
+
+bool audio_resample_init(int channelCount, int inRate, int outRate, int maxInFrames);
+void audio_resample_destroy();
+void audio_resample_prime(const short* frames, int count);
+int audio_resample_max_frames(int inFrames);
+int audio_resample(const short* in, int inFrames, short* out, int maxOutFrames, double adjust);
+
+// Sinks without a device for benchmarking, selected with -audio nullsink or -audio <file>.wav
+extern AUDIO_RENDERER_CALLBACKS audio_callbacks_null;
+extern AUDIO_RENDERER_CALLBACKS audio_callbacks_wav;
+bool audio_wav_file(const char* audio_device);
+
 #ifdef HAVE_ALSA
 extern AUDIO_RENDERER_CALLBACKS audio_callbacks_alsa;
 #endif
 #ifdef HAVE_SDL
+// Selected with -audio sdl
 extern AUDIO_RENDERER_CALLBACKS audio_callbacks_sdl;
 #endif
 #ifdef HAVE_PULSE
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include "audio.h"
+#include "../avsync.h"
+
+#include <opus_multistream.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Must be a power of two
+#define AUDIO_QUEUE_SIZE 64
+#define AUDIO_PACKET_SIZE 2048
+
+// Target queue latency limits, the device buffer comes on top of this
+#define AUDIO_INITIAL_MS 20
+#define AUDIO_MAX_MS 200
+// Added to the target on every underrun
+#define AUDIO_GROW_MS 10
+// Time without underrun before the target shrinks by one packet
+#define AUDIO_STABLE_MS 10000
+// Queue fill error that takes the rate adjustment to its limit
+#define AUDIO_DRIFT_RANGE_MS 20
+
+// Upper bound for the queue latency in ms, 0 keeps AUDIO_MAX_MS
+int audioLatencyCeiling = 0;
+
+struct audio_packet {
+  int length;
+  uint64_t arrivalUs;
+  char data[AUDIO_PACKET_SIZE];
+};
+
+// Single producer (packet receive thread), single consumer (audio thread)
+static struct audio_packet queue[AUDIO_QUEUE_SIZE];
+static atomic_uint queueHead, queueTail;
+static sem_t queueSem;
+
+static pthread_t audioThread;
+static bool audioRunning = false;
+static atomic_bool audioStopping;
+static Audio_Play audioPlay;
+
+static int packetUs, sampleRate;
+// Clock of the sinks without a device, only touched by the audio thread
+static uint64_t paceStartUs, paceFrames;
+static int targetPackets, minPackets, maxPackets, ceilingPackets, growPackets, stablePackets;
+static atomic_ulong deviceXruns;
+// Smoothed distance of the queue from its target, only touched by the audio thread
+static double fillErrorMs;
+
+static struct audio_stats stats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Same clock as the video presentation timestamps
+static inline uint64_t audio_time_us() {
+  return avsync_time_us();
+}
+
+static inline int audio_queue_depth() {
+  return atomic_load_explicit(&queueHead, memory_order_acquire) - atomic_load_explicit(&queueTail, memory_order_acquire);
+}
+
+static void audio_core_grow() {
+  targetPackets += growPackets;
+  if (targetPackets > maxPackets)
+    targetPackets = maxPackets;
+}
+
+static void* audio_core_thread(void *data) {
+  pthread_setname_np(pthread_self(), "m_audio_t");
+
+  int credits = 0;
+  bool prefill = true;
+  int played = 0;
+  int minDepth = INT_MAX;
+  unsigned long lastXruns = 0;
+
+  while (!atomic_load(&audioStopping)) {
+    if (credits == 0) {
+      if (sem_trywait(&queueSem) == 0) {
+        credits++;
+      } else if (!prefill) {
+        // The device is draining what is left, wait until the larger target is queued again
+        pthread_mutex_lock(&statsLock);
+        stats.underruns++;
+        pthread_mutex_unlock(&statsLock);
+        audio_core_grow();
+        played = 0;
+        minDepth = INT_MAX;
+        prefill = true;
+      }
+    }
+    if (prefill) {
+      while (credits < targetPackets && !atomic_load(&audioStopping)) {
+        sem_wait(&queueSem);
+        credits++;
+      }
+      prefill = false;
+    }
+    if (atomic_load(&audioStopping))
+      break;
+
+    int depth = audio_queue_depth();
+    unsigned int tail = atomic_load_explicit(&queueTail, memory_order_relaxed);
+    struct audio_packet *packet = &queue[tail & (AUDIO_QUEUE_SIZE - 1)];
+    bool drop = false;
+
+    // Packets held back for A/V sync are not part of the jitter buffer
+    int syncDelayUs = avsync_audio_delay_us();
+    if (syncDelayUs > 0) {
+      uint64_t due = packet->arrivalUs + syncDelayUs;
+      if (due > audio_time_us()) {
+        struct timespec wake = { .tv_sec = due / 1000000, .tv_nsec = (due % 1000000) * 1000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+        depth = audio_queue_depth();
+      }
+      depth -= syncDelayUs / packetUs;
+      if (depth < 1)
+        depth = 1;
+    }
+
+    unsigned long xruns = atomic_load(&deviceXruns);
+    if (xruns != lastXruns) {
+      lastXruns = xruns;
+      audio_core_grow();
+      played = 0;
+      minDepth = INT_MAX;
+    }
+
+    fillErrorMs += ((depth - targetPackets) * packetUs / 1000.0 - fillErrorMs) / 100;
+
+    if (depth < minDepth)
+      minDepth = depth;
+    if (++played >= stablePackets) {
+      // The queue never ran dry during the window, so give back one packet of latency
+      if (minDepth > 1 && targetPackets > minPackets) {
+        targetPackets--;
+        drop = true;
+      }
+      played = 0;
+      minDepth = INT_MAX;
+    }
+    // Catch up after a burst instead of keeping the extra latency
+    if (depth > 2 * targetPackets + growPackets || depth > ceilingPackets)
+      drop = true;
+
+    if (!drop)
+      audioPlay(packet->data, packet->length);
+    uint64_t arrivalUs = packet->arrivalUs;
+
+    atomic_store_explicit(&queueTail, tail + 1, memory_order_release);
+    credits--;
+
+    pthread_mutex_lock(&statsLock);
+    int deviceLatencyUs = stats.deviceLatencyUs;
+    stats.packets++;
+    if (drop)
+      stats.drops++;
+    stats.depthSum += depth;
+    if (depth > stats.maxDepth)
+      stats.maxDepth = depth;
+    stats.targetMs = targetPackets * packetUs / 1000;
+    pthread_mutex_unlock(&statsLock);
+
+    if (!drop)
+      avsync_audio_played(arrivalUs, deviceLatencyUs);
+  }
+
+  return NULL;
+}
+
+int audio_core_start(POPUS_MULTISTREAM_CONFIGURATION opusConfig, Audio_Play play) {
+  packetUs = (int) ((int64_t) opusConfig->samplesPerFrame * 1000000 / opusConfig->sampleRate);
+  if (packetUs <= 0)
+    return -1;
+  sampleRate = opusConfig->sampleRate;
+  paceStartUs = 0;
+
+  minPackets = 1;
+  // The ceiling has to fit the queue, one slot stays free to tell a full queue from an empty one
+  int ceilingMs = audioLatencyCeiling > 0 ? audioLatencyCeiling : AUDIO_MAX_MS;
+  int requestedPackets = ceilingMs * 1000 / packetUs;
+  ceilingPackets = requestedPackets;
+  if (ceilingPackets > AUDIO_QUEUE_SIZE - 1)
+    ceilingPackets = AUDIO_QUEUE_SIZE - 1;
+  if (ceilingPackets < minPackets)
+    ceilingPackets = minPackets;
+  if (ceilingPackets != requestedPackets)
+    fprintf(stderr, "Audio latency ceiling of %d ms doesn't fit the queue, using %d ms\n", ceilingMs, ceilingPackets * packetUs / 1000);
+  // Leave the target room below the ceiling for bursts
+  maxPackets = ceilingPackets;
+  if (maxPackets > AUDIO_QUEUE_SIZE / 2)
+    maxPackets = AUDIO_QUEUE_SIZE / 2;
+  growPackets = (AUDIO_GROW_MS * 1000 + packetUs - 1) / packetUs;
+  stablePackets = AUDIO_STABLE_MS * 1000 / packetUs;
+  targetPackets = AUDIO_INITIAL_MS * 1000 / packetUs;
+  if (targetPackets > maxPackets)
+    targetPackets = maxPackets;
+  if (targetPackets < minPackets)
+    targetPackets = minPackets;
+
+  memset(&stats, 0, sizeof(stats));
+  stats.targetMs = targetPackets * packetUs / 1000;
+  atomic_store(&deviceXruns, 0);
+  fillErrorMs = 0;
+  atomic_store(&queueHead, 0);
+  atomic_store(&queueTail, 0);
+  atomic_store(&audioStopping, false);
+  audioPlay = play;
+
+  sem_init(&queueSem, 0, 0);
+  if (pthread_create(&audioThread, NULL, audio_core_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to create audio thread\n");
+    sem_destroy(&queueSem);
+    return -1;
+  }
+  audioRunning = true;
+
+  return 0;
+}
+
+void audio_core_stop() {
+  if (!audioRunning)
+    return;
+
+  atomic_store(&audioStopping, true);
+  sem_post(&queueSem);
+  pthread_join(audioThread, NULL);
+  sem_destroy(&queueSem);
+  audioRunning = false;
+}
+
+void audio_core_submit(char* data, int length) {
+  if (length > AUDIO_PACKET_SIZE) {
+    fprintf(stderr, "Audio packet of %d bytes is too large\n", length);
+    return;
+  }
+
+  unsigned int head = atomic_load_explicit(&queueHead, memory_order_relaxed);
+  if (head - atomic_load_explicit(&queueTail, memory_order_acquire) >= AUDIO_QUEUE_SIZE) {
+    pthread_mutex_lock(&statsLock);
+    stats.overflows++;
+    pthread_mutex_unlock(&statsLock);
+    return;
+  }
+
+  struct audio_packet *packet = &queue[head & (AUDIO_QUEUE_SIZE - 1)];
+  memcpy(packet->data, data, length);
+  packet->length = length;
+  packet->arrivalUs = audio_time_us();
+  atomic_store_explicit(&queueHead, head + 1, memory_order_release);
+  sem_post(&queueSem);
+}
+
+int audio_core_decode(struct OpusMSDecoder* decoder, char* data, int length, short* pcm, int frames) {
+  uint64_t start = audio_time_us();
+  int decodeLen = opus_multistream_decode(decoder, (unsigned char*) data, length, pcm, frames, 0);
+  int elapsed = (int) (audio_time_us() - start);
+
+  if (decodeLen < 0) {
+    printf("Opus error from decode: %d\n", decodeLen);
+    return decodeLen;
+  }
+
+  pthread_mutex_lock(&statsLock);
+  stats.decodes++;
+  stats.decodeUs += elapsed;
+  if (elapsed > stats.maxDecodeUs)
+    stats.maxDecodeUs = elapsed;
+  pthread_mutex_unlock(&statsLock);
+
+  return decodeLen;
+}
+
+void audio_core_mix(const short* in, short* out, int frames) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  audio_mix(in, out, frames);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&statsLock);
+  stats.mixFrames += frames;
+  stats.mixNs += (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+  pthread_mutex_unlock(&statsLock);
+}
+
+// Playback speed factor for resampling backends, above 1 when the queue is too full.
+// Errors within one packet are jitter, not drift. Only call it from the audio thread.
+double audio_core_rate_adjust() {
+  double deadband = packetUs / 1000.0;
+  if (fillErrorMs > -deadband && fillErrorMs < deadband)
+    return 1.0;
+
+  double error = fillErrorMs > 0 ? fillErrorMs - deadband : fillErrorMs + deadband;
+  double adjust = error / AUDIO_DRIFT_RANGE_MS * AUDIO_RESAMPLE_MAX_ADJUST;
+  if (adjust > AUDIO_RESAMPLE_MAX_ADJUST)
+    adjust = AUDIO_RESAMPLE_MAX_ADJUST;
+  else if (adjust < -AUDIO_RESAMPLE_MAX_ADJUST)
+    adjust = -AUDIO_RESAMPLE_MAX_ADJUST;
+  return 1.0 + adjust;
+}
+
+// Latency the backend measured between its write and the speaker
+void audio_core_device_latency(int us) {
+  pthread_mutex_lock(&statsLock);
+  stats.deviceLatencyUs = us;
+  if (us > stats.maxDeviceLatencyUs)
+    stats.maxDeviceLatencyUs = us;
+  pthread_mutex_unlock(&statsLock);
+}
+
+// Blocks until a virtual device would start playing the next frames, for sinks without a device clock
+void audio_core_pace(int frames) {
+  uint64_t now = audio_time_us();
+  uint64_t deadline = paceStartUs + paceFrames * 1000000 / sampleRate;
+  if (paceStartUs == 0 || now > deadline + packetUs) {
+    // The virtual device ran dry, restart its clock
+    if (paceStartUs != 0)
+      audio_core_xrun();
+    paceStartUs = deadline = now;
+    paceFrames = 0;
+  }
+
+  struct timespec wake = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+  paceFrames += frames;
+
+  int64_t error = (int64_t) (audio_time_us() - deadline);
+  pthread_mutex_lock(&statsLock);
+  stats.paced++;
+  stats.paceErrorUs += error;
+  if (error > stats.maxPaceErrorUs)
+    stats.maxPaceErrorUs = error;
+  pthread_mutex_unlock(&statsLock);
+}
+
+// Called by the backends when the device itself ran out of samples
+void audio_core_xrun() {
+  atomic_fetch_add(&deviceXruns, 1);
+}
+
+void audio_core_get_stats(struct audio_stats* out) {
+  pthread_mutex_lock(&statsLock);
+  *out = stats;
+  pthread_mutex_unlock(&statsLock);
+  out->xruns = atomic_load(&deviceXruns);
+}
+
+void audio_core_print_stats() {
+  struct audio_stats current;
+  audio_core_get_stats(&current);
+  if (current.packets == 0 && current.overflows == 0)
+    return;
+
+  printf("Audio: %lu packets, %lu underruns, %lu device xruns, %lu dropped, %lu overflowed\n",
+         current.packets, current.underruns, current.xruns, current.drops, current.overflows);
+  printf("Audio: target latency %d ms, queue depth avg %.1f max %d, decode avg %lu us max %d us\n",
+         current.targetMs, current.packets > 0 ? (double) current.depthSum / current.packets : 0.0, current.maxDepth,
+         current.decodes > 0 ? current.decodeUs / current.decodes : 0, current.maxDecodeUs);
+  if (current.maxDeviceLatencyUs > 0)
+    printf("Audio: device latency %.1f ms, max %.1f ms\n", current.deviceLatencyUs / 1000.0, current.maxDeviceLatencyUs / 1000.0);
+  if (current.paced > 0)
+    printf("Audio: pacing error avg %lu us max %d us\n", current.paceErrorUs / current.paced, current.maxPaceErrorUs);
+  if (current.mixFrames > 0)
+    printf("Audio: downmix %.1f ns per frame over %lu frames\n", (double) current.mixNs / current.mixFrames, current.mixFrames);
+}
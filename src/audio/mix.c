@@ -0,0 +1,142 @@
+#include "audio.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define MIX_MAX_CHANNELS 8
+#define MIX_HALF 0.70710678f
+
+// Channels are in ALSA order: FL-FR-RL-RR-C-LFE-SL-SR
+enum { FL, FR, RL, RR, C, LFE, SL, SR };
+
+struct mix_layout {
+  int inChannels;
+  int outChannels;
+  // Weight of each input channel per output channel, LFE is left out of stereo
+  float matrix[MIX_MAX_CHANNELS][MIX_MAX_CHANNELS];
+};
+
+static const struct mix_layout layouts[] = {
+  { 8, 6, {
+    [FL] = { [FL] = 1 },
+    [FR] = { [FR] = 1 },
+    [RL] = { [RL] = MIX_HALF, [SL] = MIX_HALF },
+    [RR] = { [RR] = MIX_HALF, [SR] = MIX_HALF },
+    [C] = { [C] = 1 },
+    [LFE] = { [LFE] = 1 },
+  } },
+  { 8, 2, {
+    [FL] = { [FL] = 1, [C] = MIX_HALF, [RL] = MIX_HALF, [SL] = MIX_HALF },
+    [FR] = { [FR] = 1, [C] = MIX_HALF, [RR] = MIX_HALF, [SR] = MIX_HALF },
+  } },
+  { 6, 2, {
+    [FL] = { [FL] = 1, [C] = MIX_HALF, [RL] = MIX_HALF },
+    [FR] = { [FR] = 1, [C] = MIX_HALF, [RR] = MIX_HALF },
+  } },
+};
+
+// Transposed so one input sample scales a whole output frame at once
+static float columns[MIX_MAX_CHANNELS][MIX_MAX_CHANNELS] __attribute__((aligned(16)));
+static int mixIn, mixOut;
+
+const char* audioDownmixMatrix = NULL;
+
+// Rows of comma separated weights, one row per output channel in ALSA order
+static bool audio_mix_parse(const char* spec, int inChannels, int outChannels) {
+  const char* ptr = spec;
+  char* end;
+
+  memset(columns, 0, sizeof(columns));
+  for (int i = 0; i < inChannels * outChannels; i++) {
+    float weight = strtof(ptr, &end);
+    if (end == ptr)
+      return false;
+    columns[i % inChannels][i / inChannels] = weight;
+    ptr = end;
+    while (*ptr == ',' || *ptr == ' ')
+      ptr++;
+  }
+  return *ptr == '\0';
+}
+
+bool audio_mix_init(int inChannels, int outChannels) {
+  if (audioDownmixMatrix != NULL) {
+    if (audio_mix_parse(audioDownmixMatrix, inChannels, outChannels)) {
+      mixIn = inChannels;
+      mixOut = outChannels;
+      return true;
+    }
+    fprintf(stderr, "Downmix matrix needs %d rows of %d weights, using the default\n", outChannels, inChannels);
+  }
+
+  for (int i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+    if (layouts[i].inChannels != inChannels || layouts[i].outChannels != outChannels)
+      continue;
+
+    memset(columns, 0, sizeof(columns));
+    for (int out = 0; out < outChannels; out++) {
+      for (int in = 0; in < inChannels; in++)
+        columns[in][out] = layouts[i].matrix[out][in];
+    }
+    mixIn = inChannels;
+    mixOut = outChannels;
+    return true;
+  }
+
+  return false;
+}
+
+#if defined(__ARM_NEON)
+// Round to nearest like the SSE and scalar paths, vcvtq alone truncates
+static inline int32x4_t mix_round(float32x4_t v) {
+#if defined(__aarch64__)
+  return vcvtnq_s32_f32(v);
+#else
+  uint32x4_t negative = vcltq_f32(v, vdupq_n_f32(0));
+  return vcvtq_s32_f32(vaddq_f32(v, vbslq_f32(negative, vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f))));
+#endif
+}
+#endif
+
+// Mixes interleaved S16 frames, saturating instead of scaling down the front channels
+void audio_mix(const short* in, short* out, int frames) {
+  short frame[MIX_MAX_CHANNELS] __attribute__((aligned(16)));
+
+  for (int f = 0; f < frames; f++, in += mixIn, out += mixOut) {
+#if defined(__SSE2__)
+    __m128 low = _mm_setzero_ps();
+    __m128 high = _mm_setzero_ps();
+    for (int i = 0; i < mixIn; i++) {
+      __m128 sample = _mm_set1_ps(in[i]);
+      low = _mm_add_ps(low, _mm_mul_ps(sample, _mm_load_ps(&columns[i][0])));
+      high = _mm_add_ps(high, _mm_mul_ps(sample, _mm_load_ps(&columns[i][4])));
+    }
+    _mm_store_si128((__m128i*) frame, _mm_packs_epi32(_mm_cvtps_epi32(low), _mm_cvtps_epi32(high)));
+#elif defined(__ARM_NEON)
+    float32x4_t low = vdupq_n_f32(0);
+    float32x4_t high = vdupq_n_f32(0);
+    for (int i = 0; i < mixIn; i++) {
+      low = vmlaq_n_f32(low, vld1q_f32(&columns[i][0]), in[i]);
+      high = vmlaq_n_f32(high, vld1q_f32(&columns[i][4]), in[i]);
+    }
+    vst1q_s16(frame, vcombine_s16(vqmovn_s32(mix_round(low)), vqmovn_s32(mix_round(high))));
+#else
+    for (int o = 0; o < mixOut; o++) {
+      float sum = 0;
+      for (int i = 0; i < mixIn; i++)
+        sum += columns[i][o] * in[i];
+      long sample = lrintf(sum);
+      frame[o] = sample > 32767 ? 32767 : (sample < -32768 ? -32768 : (short) sample);
+    }
+#endif
+    memcpy(out, frame, mixOut * sizeof(short));
+  }
+}
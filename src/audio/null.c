@@ -0,0 +1,52 @@
+#include "audio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <opus_multistream.h>
+
+static OpusMSDecoder* decoder;
+static short* pcmBuffer;
+static int samplesPerFrame;
+
+static void null_renderer_play(char* data, int length) {
+  int decodeLen = audio_core_decode(decoder, data, length, pcmBuffer, samplesPerFrame);
+  if (decodeLen > 0)
+    audio_core_pace(decodeLen);
+}
+
+static int null_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
+  int rc;
+  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, opusConfig->mapping, &rc);
+  if (decoder == NULL) {
+    printf("Failed to create Opus decoder: %d\n", rc);
+    return -1;
+  }
+
+  samplesPerFrame = opusConfig->samplesPerFrame;
+  pcmBuffer = malloc(sizeof(short) * opusConfig->channelCount * samplesPerFrame);
+  if (pcmBuffer == NULL)
+    return -1;
+
+  return audio_core_start(opusConfig, null_renderer_play);
+}
+
+static void null_renderer_cleanup() {
+  audio_core_stop();
+
+  if (decoder != NULL) {
+    opus_multistream_decoder_destroy(decoder);
+    decoder = NULL;
+  }
+
+  if (pcmBuffer != NULL) {
+    free(pcmBuffer);
+    pcmBuffer = NULL;
+  }
+}
+
+AUDIO_RENDERER_CALLBACKS audio_callbacks_null = {
+  .init = null_renderer_init,
+  .cleanup = null_renderer_cleanup,
+  .decodeAndPlaySample = audio_core_submit,
+  .capabilities = CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION,
+};
@@ -24,33 +24,153 @@
 #include <string.h>
 
 #include <opus_multistream.h>
-#include <pulse/simple.h>
-#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
+
+// Requested stream latency, the jitter queue in front of it absorbs network jitter
+#define PULSE_TARGET_MS 20
+// Decoded packets handed over to the write request callback
+#define PULSE_RING_PACKETS 2
 
 static OpusMSDecoder* decoder;
-static pa_simple *dev = NULL;
+static pa_threaded_mainloop *mainloop;
+static pa_context *pulseContext;
+static pa_stream *stream;
 static short* pcmBuffer;
 static int samplesPerFrame;
 static int channelCount;
+static bool stopping;
+
+static char* ringBuffer;
+static size_t ringSize, ringRead, ringFill, frameBytes;
+
+static void pulse_sink_info(pa_context *c, const pa_sink_info *info, int eol, void *userdata) {
+  if (info != NULL)
+    *(bool*) userdata = true;
+}
 
 bool audio_pulse_init(char* audio_device) {
-  pa_sample_spec spec = {
-    .format = PA_SAMPLE_S16LE,
-    .rate = 48000,
-    .channels = 2
-  };
+  pa_mainloop *loop = pa_mainloop_new();
+  pa_context *ctx = pa_context_new(pa_mainloop_get_api(loop), "Moonlight Embedded");
+  bool ready = false;
+
+  if (ctx != NULL && pa_context_connect(ctx, NULL, PA_CONTEXT_NOFLAGS, NULL) >= 0) {
+    for (;;) {
+      pa_context_state_t state = pa_context_get_state(ctx);
+      if (state == PA_CONTEXT_READY) {
+        ready = true;
+        break;
+      }
+      if (!PA_CONTEXT_IS_GOOD(state) || pa_mainloop_iterate(loop, 1, NULL) < 0)
+        break;
+    }
+
+    // A device name that isn't a sink is meant for ALSA
+    if (ready && audio_device != NULL) {
+      bool found = false;
+      pa_operation *op = pa_context_get_sink_info_by_name(ctx, audio_device, pulse_sink_info, &found);
+      while (op != NULL && pa_operation_get_state(op) == PA_OPERATION_RUNNING && pa_mainloop_iterate(loop, 1, NULL) >= 0);
+      if (op != NULL)
+        pa_operation_unref(op);
+      ready = found;
+    }
+    pa_context_disconnect(ctx);
+  }
+
+  if (ctx != NULL)
+    pa_context_unref(ctx);
+  pa_mainloop_free(loop);
+
+  return ready;
+}
+
+// Hands as much of the ring to the stream as it asks for, called with the mainloop lock held
+static void pulse_stream_write() {
+  size_t writable = pa_stream_writable_size(stream);
+  if (writable == (size_t) -1)
+    writable = 0;
+
+  while (writable > 0 && ringFill > 0) {
+    size_t chunk = writable < ringFill ? writable : ringFill;
+    if (chunk > ringSize - ringRead)
+      chunk = ringSize - ringRead;
+    chunk -= chunk % frameBytes;
+    if (chunk == 0)
+      break;
+
+    void *dst;
+    size_t len = chunk;
+    if (pa_stream_begin_write(stream, &dst, &len) < 0)
+      break;
+    if (len < frameBytes) {
+      pa_stream_cancel_write(stream);
+      break;
+    }
+    if (len > chunk)
+      len = chunk;
+    len -= len % frameBytes;
+
+    memcpy(dst, ringBuffer + ringRead, len);
+    if (pa_stream_write(stream, dst, len, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+      printf("Pulseaudio error: %s\n", pa_strerror(pa_context_errno(pulseContext)));
+      pa_stream_cancel_write(stream);
+      break;
+    }
+    ringRead = (ringRead + len) % ringSize;
+    ringFill -= len;
+    writable -= len;
+  }
+
+  // Wake the audio thread waiting for ring space
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void pulse_stream_request(pa_stream *s, size_t nbytes, void *userdata) {
+  pulse_stream_write();
+}
+
+static void pulse_stream_underflow(pa_stream *s, void *userdata) {
+  audio_core_xrun();
+}
 
-  int error;
-  dev = pa_simple_new(NULL, "Moonlight Embedded", PA_STREAM_PLAYBACK, audio_device, "Streaming", &spec, NULL, NULL, &error);
+static void pulse_context_state(pa_context *c, void *userdata) {
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void pulse_stream_state(pa_stream *s, void *userdata) {
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void pulse_renderer_play(char* data, int length) {
+  int decodeLen = audio_core_decode(decoder, data, length, pcmBuffer, samplesPerFrame);
+  if (decodeLen <= 0)
+    return;
+
+  size_t bytes = decodeLen * frameBytes;
+  pa_threaded_mainloop_lock(mainloop);
+  while (ringSize - ringFill < bytes && !stopping && pa_stream_get_state(stream) == PA_STREAM_READY)
+    pa_threaded_mainloop_wait(mainloop);
+
+  if (stopping || pa_stream_get_state(stream) != PA_STREAM_READY) {
+    pa_threaded_mainloop_unlock(mainloop);
+    return;
+  }
 
-  if (dev)
-    pa_simple_free(dev);
+  size_t ringWrite = (ringRead + ringFill) % ringSize;
+  size_t first = bytes < ringSize - ringWrite ? bytes : ringSize - ringWrite;
+  memcpy(ringBuffer + ringWrite, pcmBuffer, first);
+  memcpy(ringBuffer, (char*) pcmBuffer + first, bytes - first);
+  ringFill += bytes;
+  pulse_stream_write();
 
-  return (bool) dev;
+  pa_usec_t latency;
+  int negative;
+  if (pa_stream_get_latency(stream, &latency, &negative) == 0)
+    audio_core_device_latency(negative ? 0 : (int) latency);
+  pa_threaded_mainloop_unlock(mainloop);
 }
 
 static int pulse_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
-  int rc, error;
+  int rc;
   unsigned char alsaMapping[AUDIO_CONFIGURATION_MAX_CHANNEL_COUNT];
 
   channelCount = opusConfig->channelCount;
@@ -59,6 +179,13 @@ static int pulse_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGU
   if (pcmBuffer == NULL)
     return -1;
 
+  frameBytes = sizeof(short) * channelCount;
+  ringSize = PULSE_RING_PACKETS * samplesPerFrame * frameBytes;
+  ringRead = ringFill = 0;
+  ringBuffer = malloc(ringSize);
+  if (ringBuffer == NULL)
+    return -1;
+
   /* The supplied mapping array has order: FL-FR-C-LFE-RL-RR-SL-SR
    * ALSA expects the order: FL-FR-RL-RR-C-LFE-SL-SR
    * We need copy the mapping locally and swap the channels around.
@@ -82,48 +209,109 @@ static int pulse_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGU
   pa_channel_map map;
   pa_channel_map_init_auto(&map, opusConfig->channelCount, PA_CHANNEL_MAP_ALSA);
 
-  char* audio_device = (char*) context;
-  dev = pa_simple_new(NULL, "Moonlight Embedded", PA_STREAM_PLAYBACK, audio_device, "Streaming", &spec, &map, NULL, &error);
+  pa_buffer_attr attr = {
+    .maxlength = (uint32_t) -1,
+    .tlength = pa_usec_to_bytes(PULSE_TARGET_MS * 1000, &spec),
+    .prebuf = (uint32_t) -1,
+    .minreq = samplesPerFrame * frameBytes,
+    .fragsize = (uint32_t) -1,
+  };
 
-  if (!dev) {
-    printf("Pulseaudio error: %s\n", pa_strerror(error));
+  stopping = false;
+  mainloop = pa_threaded_mainloop_new();
+  if (mainloop == NULL)
+    return -1;
+  pulseContext = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "Moonlight Embedded");
+  if (pulseContext == NULL)
     return -1;
+  pa_context_set_state_callback(pulseContext, pulse_context_state, NULL);
+
+  pa_threaded_mainloop_lock(mainloop);
+  if (pa_context_connect(pulseContext, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 || pa_threaded_mainloop_start(mainloop) < 0)
+    goto error;
+
+  pa_context_state_t contextState;
+  while ((contextState = pa_context_get_state(pulseContext)) != PA_CONTEXT_READY) {
+    if (!PA_CONTEXT_IS_GOOD(contextState))
+      goto error;
+    pa_threaded_mainloop_wait(mainloop);
   }
 
-  return 0;
-}
+  stream = pa_stream_new(pulseContext, "Streaming", &spec, &map);
+  if (stream == NULL)
+    goto error;
+  pa_stream_set_state_callback(stream, pulse_stream_state, NULL);
+  pa_stream_set_write_callback(stream, pulse_stream_request, NULL);
+  pa_stream_set_underflow_callback(stream, pulse_stream_underflow, NULL);
 
-static void pulse_renderer_decode_and_play_sample(char* data, int length) {
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, samplesPerFrame, 0);
-  if (decodeLen > 0) {
-    int error;
-    int rc = pa_simple_write(dev, pcmBuffer, decodeLen * sizeof(short) * channelCount, &error);
+  char* audio_device = (char*) context;
+  pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+  if (pa_stream_connect_playback(stream, audio_device, &attr, flags, NULL, NULL) < 0)
+    goto error;
 
-    if (rc<0)
-      printf("Pulseaudio error: %s\n", pa_strerror(error));
-  } else if (decodeLen < 0) {
-    printf("Opus error from decode: %d\n", decodeLen);
+  pa_stream_state_t streamState;
+  while ((streamState = pa_stream_get_state(stream)) != PA_STREAM_READY) {
+    if (!PA_STREAM_IS_GOOD(streamState))
+      goto error;
+    pa_threaded_mainloop_wait(mainloop);
   }
+
+  const pa_buffer_attr *granted = pa_stream_get_buffer_attr(stream);
+  if (granted != NULL)
+    printf("Pulseaudio buffer: tlength %u bytes, minreq %u bytes\n", granted->tlength, granted->minreq);
+  pa_threaded_mainloop_unlock(mainloop);
+
+  return audio_core_start(opusConfig, pulse_renderer_play);
+
+error:
+  printf("Pulseaudio error: %s\n", pa_strerror(pa_context_errno(pulseContext)));
+  pa_threaded_mainloop_unlock(mainloop);
+  return -1;
 }
 
 static void pulse_renderer_cleanup() {
+  if (mainloop != NULL) {
+    pa_threaded_mainloop_lock(mainloop);
+    stopping = true;
+    pa_threaded_mainloop_signal(mainloop, 0);
+    pa_threaded_mainloop_unlock(mainloop);
+  }
+  audio_core_stop();
+
+  if (mainloop != NULL) {
+    pa_threaded_mainloop_lock(mainloop);
+    if (stream != NULL) {
+      pa_stream_disconnect(stream);
+      pa_stream_unref(stream);
+      stream = NULL;
+    }
+    if (pulseContext != NULL) {
+      pa_context_disconnect(pulseContext);
+      pa_context_unref(pulseContext);
+      pulseContext = NULL;
+    }
+    pa_threaded_mainloop_unlock(mainloop);
+    pa_threaded_mainloop_stop(mainloop);
+    pa_threaded_mainloop_free(mainloop);
+    mainloop = NULL;
+  }
   if (decoder != NULL) {
     opus_multistream_decoder_destroy(decoder);
     decoder = NULL;
   }
-  if (dev != NULL) {
-    pa_simple_free(dev);
-    dev = NULL;
-  }
   if (pcmBuffer != NULL) {
     free(pcmBuffer);
     pcmBuffer = NULL;
   }
+  if (ringBuffer != NULL) {
+    free(ringBuffer);
+    ringBuffer = NULL;
+  }
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_pulse = {
   .init = pulse_renderer_init,
   .cleanup = pulse_renderer_cleanup,
-  .decodeAndPlaySample = pulse_renderer_decode_and_play_sample,
+  .decodeAndPlaySample = audio_core_submit,
   .capabilities = CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION,
 };
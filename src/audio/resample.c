@@ -0,0 +1,172 @@
+#include "audio.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define RESAMPLE_PHASES 128
+// Passband edge relative to the lower of both Nyquist frequencies
+#define RESAMPLE_CUTOFF 0.92
+
+// History frames are padded to a full vector of 4 or 8 floats
+static float *history;
+static int historyFrames, historyCount, stride, channels;
+static float *filter;
+static double position, ratio;
+
+static inline double sinc(double x) {
+  return x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+}
+
+bool audio_resample_init(int channelCount, int inRate, int outRate, int maxInFrames) {
+  audio_resample_destroy();
+
+  channels = channelCount;
+  stride = channels <= 4 ? 4 : 8;
+  ratio = (double) inRate / outRate;
+  historyFrames = AUDIO_RESAMPLE_TAPS + 2 * maxInFrames;
+  if (posix_memalign((void**) &history, 16, sizeof(float) * stride * historyFrames) != 0 ||
+      posix_memalign((void**) &filter, 16, sizeof(float) * AUDIO_RESAMPLE_TAPS * (RESAMPLE_PHASES + 1)) != 0) {
+    fprintf(stderr, "Not enough memory for the audio resampler\n");
+    audio_resample_destroy();
+    return false;
+  }
+  memset(history, 0, sizeof(float) * stride * historyFrames);
+
+  // Blackman windowed sinc, one extra phase so neighbouring phases can be interpolated
+  double cutoff = RESAMPLE_CUTOFF * (outRate < inRate ? (double) outRate / inRate : 1);
+  for (int p = 0; p <= RESAMPLE_PHASES; p++) {
+    float *taps = filter + p * AUDIO_RESAMPLE_TAPS;
+    double sum = 0;
+    for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++) {
+      double x = k - AUDIO_RESAMPLE_TAPS / 2 + 1 - (double) p / RESAMPLE_PHASES;
+      double window = 0.42 + 0.5 * cos(2 * M_PI * x / AUDIO_RESAMPLE_TAPS) + 0.08 * cos(4 * M_PI * x / AUDIO_RESAMPLE_TAPS);
+      taps[k] = cutoff * sinc(cutoff * x) * window;
+      sum += taps[k];
+    }
+    for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++)
+      taps[k] /= sum;
+  }
+
+  // Start with silence so the first output is centered on the first input frame
+  historyCount = AUDIO_RESAMPLE_TAPS / 2 - 1;
+  position = 0;
+  return true;
+}
+
+void audio_resample_destroy() {
+  free(history);
+  free(filter);
+  history = NULL;
+  filter = NULL;
+}
+
+static void audio_resample_append(const short* in, int frames) {
+  if (historyCount + frames > historyFrames) {
+    // Should not happen, the caller drains every packet
+    int drop = historyCount + frames - historyFrames;
+    memmove(history, history + drop * stride, sizeof(float) * stride * (historyCount - drop));
+    historyCount -= drop;
+    position = position > drop ? position - drop : 0;
+  }
+
+  float *dst = history + historyCount * stride;
+  for (int f = 0; f < frames; f++, in += channels, dst += stride) {
+    for (int c = 0; c < channels; c++)
+      dst[c] = in[c];
+  }
+  historyCount += frames;
+}
+
+// Continue from frames that were already played, so switching the resampler in doesn't click
+void audio_resample_prime(const short* frames, int count) {
+  historyCount = 0;
+  if (count < AUDIO_RESAMPLE_TAPS) {
+    memset(history, 0, sizeof(float) * stride * (AUDIO_RESAMPLE_TAPS - count));
+    historyCount = AUDIO_RESAMPLE_TAPS - count;
+  }
+  audio_resample_append(frames, count);
+  // The first output lands right after the last primed frame
+  position = historyCount - AUDIO_RESAMPLE_TAPS / 2 + 1;
+}
+
+int audio_resample_max_frames(int inFrames) {
+  return (int) ceil(inFrames / ratio * (1 + AUDIO_RESAMPLE_MAX_ADJUST)) + 2;
+}
+
+// Adjust slightly scales the speed to keep the device queue at its target
+int audio_resample(const short* in, int inFrames, short* out, int maxOutFrames, double adjust) {
+  float coef[AUDIO_RESAMPLE_TAPS] __attribute__((aligned(16)));
+  float frame[8] __attribute__((aligned(16)));
+  double step = ratio * adjust;
+  int produced = 0;
+
+  audio_resample_append(in, inFrames);
+
+  while (position + AUDIO_RESAMPLE_TAPS <= historyCount && produced < maxOutFrames) {
+    int base = (int) position;
+    double phase = (position - base) * RESAMPLE_PHASES;
+    int p = (int) phase;
+    float weight = phase - p;
+    const float *f0 = filter + p * AUDIO_RESAMPLE_TAPS;
+    const float *f1 = f0 + AUDIO_RESAMPLE_TAPS;
+    for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++)
+      coef[k] = f0[k] + weight * (f1[k] - f0[k]);
+
+    const float *x = history + base * stride;
+#if defined(__SSE2__)
+    __m128 low = _mm_setzero_ps();
+    __m128 high = _mm_setzero_ps();
+    for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++, x += stride) {
+      __m128 c = _mm_set1_ps(coef[k]);
+      low = _mm_add_ps(low, _mm_mul_ps(c, _mm_load_ps(x)));
+      if (stride == 8)
+        high = _mm_add_ps(high, _mm_mul_ps(c, _mm_load_ps(x + 4)));
+    }
+    _mm_store_ps(frame, low);
+    _mm_store_ps(frame + 4, high);
+#elif defined(__ARM_NEON)
+    float32x4_t low = vdupq_n_f32(0);
+    float32x4_t high = vdupq_n_f32(0);
+    for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++, x += stride) {
+      low = vmlaq_n_f32(low, vld1q_f32(x), coef[k]);
+      if (stride == 8)
+        high = vmlaq_n_f32(high, vld1q_f32(x + 4), coef[k]);
+    }
+    vst1q_f32(frame, low);
+    vst1q_f32(frame + 4, high);
+#else
+    for (int c = 0; c < channels; c++) {
+      float sum = 0;
+      for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++)
+        sum += coef[k] * x[k * stride + c];
+      frame[c] = sum;
+    }
+#endif
+    for (int c = 0; c < channels; c++) {
+      long sample = lrintf(frame[c]);
+      out[c] = sample > 32767 ? 32767 : (sample < -32768 ? -32768 : (short) sample);
+    }
+    out += channels;
+    produced++;
+    position += step;
+  }
+
+  int consumed = (int) position;
+  if (consumed > historyCount)
+    consumed = historyCount;
+  if (consumed > 0) {
+    memmove(history, history + consumed * stride, sizeof(float) * stride * (historyCount - consumed));
+    historyCount -= consumed;
+    position -= consumed;
+  }
+
+  return produced;
+}
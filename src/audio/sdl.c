@@ -19,49 +19,145 @@
 
 #include "audio.h"
 
-#include <SDL.h>
-#include <SDL_audio.h>
+#include <SDL3/SDL.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <opus_multistream.h>
 
 static OpusMSDecoder* decoder;
 static short* pcmBuffer;
-static int samplesPerFrame;
-static SDL_AudioDeviceID dev;
-static int channelCount;
+static int samplesPerFrame, sampleRate;
+static int frameSize;
+static SDL_AudioStream* stream;
+static int devicePeriod;
+static bool started, stopping;
+
+// Decoded samples waiting for the device callback, the audio thread blocks while it is full
+static char* ringBuffer;
+static int ringSize, ringRead, ringFill;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ringCond = PTHREAD_COND_INITIALIZER;
+
+// Runs on the SDL device thread whenever the device needs more samples
+static void SDLCALL sdl_renderer_feed(void* userdata, SDL_AudioStream* audioStream, int additional, int total) {
+  // Only top up what SDL asked for, it already accounts for the data still queued in the stream
+  if (additional <= 0)
+    return;
+
+  pthread_mutex_lock(&ringLock);
+  int bytes = ringFill < additional ? ringFill : additional;
+  bytes -= bytes % frameSize;
+  if (started && bytes < additional)
+    audio_core_xrun();
+
+  while (bytes > 0) {
+    int chunk = ringSize - ringRead < bytes ? ringSize - ringRead : bytes;
+    SDL_PutAudioStreamData(audioStream, ringBuffer + ringRead, chunk);
+    ringRead = (ringRead + chunk) % ringSize;
+    ringFill -= chunk;
+    bytes -= chunk;
+    started = true;
+  }
+  pthread_cond_signal(&ringCond);
+  pthread_mutex_unlock(&ringLock);
+}
+
+static void sdl_renderer_play(char* data, int length) {
+  int decodeLen = audio_core_decode(decoder, data, length, pcmBuffer, samplesPerFrame);
+  if (decodeLen <= 0)
+    return;
+
+  int bytes = decodeLen * frameSize;
+  pthread_mutex_lock(&ringLock);
+  while (ringSize - ringFill < bytes && !stopping)
+    pthread_cond_wait(&ringCond, &ringLock);
+
+  if (!stopping) {
+    int write = (ringRead + ringFill) % ringSize;
+    int chunk = ringSize - write < bytes ? ringSize - write : bytes;
+    memcpy(ringBuffer + write, pcmBuffer, chunk);
+    memcpy(ringBuffer, (char*) pcmBuffer + chunk, bytes - chunk);
+    ringFill += bytes;
+  }
+  int queued = ringFill;
+  pthread_mutex_unlock(&ringLock);
+
+  // Everything in front of this packet plus the device period SDL is playing from
+  queued += SDL_GetAudioStreamQueued(stream);
+  audio_core_device_latency((int) ((int64_t) (queued / frameSize + devicePeriod) * 1000000 / sampleRate));
+}
 
 static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
   int rc;
   decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, opusConfig->mapping, &rc);
+  if (decoder == NULL) {
+    printf("Failed to create Opus decoder: %d\n", rc);
+    return -1;
+  }
 
-  channelCount = opusConfig->channelCount;
   samplesPerFrame = opusConfig->samplesPerFrame;
-  pcmBuffer = malloc(sizeof(short) * channelCount * samplesPerFrame);
+  sampleRate = opusConfig->sampleRate;
+  frameSize = sizeof(short) * opusConfig->channelCount;
+  pcmBuffer = malloc(frameSize * samplesPerFrame);
   if (pcmBuffer == NULL)
     return -1;
 
-  SDL_InitSubSystem(SDL_INIT_AUDIO);
+  if (!SDL_InitSubSystem(SDL_INIT_AUDIO)) {
+    printf("Failed to initialize SDL audio: %s\n", SDL_GetError());
+    return -1;
+  }
 
-  SDL_AudioSpec want, have;
-  SDL_zero(want);
-  want.freq = opusConfig->sampleRate;
-  want.format = AUDIO_S16LSB;
-  want.channels = opusConfig->channelCount;
-  want.samples = 4096;
+  // Ask for a device period of one packet instead of SDL's default of several
+  char frames[16];
+  snprintf(frames, sizeof(frames), "%d", samplesPerFrame);
+  SDL_SetHint(SDL_HINT_AUDIO_DEVICE_SAMPLE_FRAMES, frames);
 
-  dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
-  if (dev == 0) {
+  // The Opus channel mapping already matches SDL's channel order
+  SDL_AudioSpec spec = {
+    .format = SDL_AUDIO_S16LE,
+    .channels = opusConfig->channelCount,
+    .freq = opusConfig->sampleRate,
+  };
+  stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, sdl_renderer_feed, NULL);
+  if (stream == NULL) {
     printf("Failed to open audio: %s\n", SDL_GetError());
     return -1;
-  } else {
-    SDL_PauseAudioDevice(dev, 0);  // start audio playing.
   }
 
-  return 0;
+  // Room for one device period plus two packets, anything beyond backs up into the core queue
+  devicePeriod = samplesPerFrame;
+  SDL_AudioSpec deviceSpec;
+  if (SDL_GetAudioDeviceFormat(SDL_GetAudioStreamDevice(stream), &deviceSpec, &devicePeriod) && devicePeriod < samplesPerFrame)
+    devicePeriod = samplesPerFrame;
+  ringSize = frameSize * (devicePeriod + 2 * samplesPerFrame);
+  ringBuffer = malloc(ringSize);
+  if (ringBuffer == NULL)
+    return -1;
+
+  ringRead = ringFill = 0;
+  started = stopping = false;
+  SDL_ResumeAudioStreamDevice(stream);
+
+  return audio_core_start(opusConfig, sdl_renderer_play);
 }
 
 static void sdl_renderer_cleanup() {
+  pthread_mutex_lock(&ringLock);
+  stopping = true;
+  pthread_cond_broadcast(&ringCond);
+  pthread_mutex_unlock(&ringLock);
+
+  audio_core_stop();
+
+  if (stream != NULL) {
+    SDL_DestroyAudioStream(stream);
+    stream = NULL;
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+  }
+
   if (decoder != NULL) {
     opus_multistream_decoder_destroy(decoder);
     decoder = NULL;
@@ -72,24 +168,15 @@ static void sdl_renderer_cleanup() {
     pcmBuffer = NULL;
   }
 
-  if (dev != 0) {
-    SDL_CloseAudioDevice(dev);
-    dev = 0;
-  }
-}
-
-static void sdl_renderer_decode_and_play_sample(char* data, int length) {
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, samplesPerFrame, 0);
-  if (decodeLen > 0) {
-    SDL_QueueAudio(dev, pcmBuffer, decodeLen * channelCount * sizeof(short));
-  } else if (decodeLen < 0) {
-    printf("Opus error from decode: %d\n", decodeLen);
+  if (ringBuffer != NULL) {
+    free(ringBuffer);
+    ringBuffer = NULL;
   }
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_sdl = {
   .init = sdl_renderer_init,
   .cleanup = sdl_renderer_cleanup,
-  .decodeAndPlaySample = sdl_renderer_decode_and_play_sample,
+  .decodeAndPlaySample = audio_core_submit,
   .capabilities = CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION,
 };
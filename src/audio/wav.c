@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include "audio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <opus_multistream.h>
+
+// Audio the writer thread may lag behind before samples are lost
+#define WAV_BUFFER_MS 1000
+#define WAV_HEADER_SIZE 44
+
+static OpusMSDecoder* decoder;
+static short* pcmBuffer;
+static int samplesPerFrame, channelCount, sampleRate;
+static FILE* wavFile;
+
+// Filled by the audio thread and drained to disk by the writer thread
+static char* ringBuffer;
+static int ringSize, ringRead, ringFill;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ringCond = PTHREAD_COND_INITIALIZER;
+static pthread_t writerThread;
+static bool writerRunning, stopping;
+static unsigned long dataBytes, lostBytes;
+
+bool audio_wav_file(const char* audio_device) {
+  size_t length = strlen(audio_device);
+  return length > 4 && strcasecmp(audio_device + length - 4, ".wav") == 0;
+}
+
+static void wav_put16(unsigned char* dst, uint16_t value) {
+  dst[0] = value & 0xff;
+  dst[1] = value >> 8;
+}
+
+static void wav_put32(unsigned char* dst, uint32_t value) {
+  wav_put16(dst, value & 0xffff);
+  wav_put16(dst + 2, value >> 16);
+}
+
+static void wav_write_header(uint32_t length) {
+  unsigned char header[WAV_HEADER_SIZE];
+  int frameSize = channelCount * sizeof(short);
+
+  memcpy(header, "RIFF", 4);
+  wav_put32(header + 4, WAV_HEADER_SIZE - 8 + length);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  wav_put32(header + 16, 16);
+  wav_put16(header + 20, 1);
+  wav_put16(header + 22, channelCount);
+  wav_put32(header + 24, sampleRate);
+  wav_put32(header + 28, sampleRate * frameSize);
+  wav_put16(header + 32, frameSize);
+  wav_put16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  wav_put32(header + 40, length);
+
+  fwrite(header, 1, sizeof(header), wavFile);
+}
+
+static void* wav_writer_thread(void* data) {
+  pthread_setname_np(pthread_self(), "m_wav_t");
+
+  pthread_mutex_lock(&ringLock);
+  while (true) {
+    while (ringFill == 0 && !stopping)
+      pthread_cond_wait(&ringCond, &ringLock);
+    if (ringFill == 0)
+      break;
+
+    // The audio thread only writes to the free part of the ring, so the file write can run unlocked
+    int chunk = ringSize - ringRead < ringFill ? ringSize - ringRead : ringFill;
+    pthread_mutex_unlock(&ringLock);
+    fwrite(ringBuffer + ringRead, 1, chunk, wavFile);
+    pthread_mutex_lock(&ringLock);
+
+    ringRead = (ringRead + chunk) % ringSize;
+    ringFill -= chunk;
+    dataBytes += chunk;
+  }
+  pthread_mutex_unlock(&ringLock);
+
+  return NULL;
+}
+
+static void wav_renderer_play(char* data, int length) {
+  int decodeLen = audio_core_decode(decoder, data, length, pcmBuffer, samplesPerFrame);
+  if (decodeLen <= 0)
+    return;
+
+  // Never block the audio thread on the disk, the lost bytes are reported instead
+  int bytes = decodeLen * channelCount * sizeof(short);
+  pthread_mutex_lock(&ringLock);
+  if (ringSize - ringFill < bytes) {
+    lostBytes += bytes;
+  } else {
+    int write = (ringRead + ringFill) % ringSize;
+    int chunk = ringSize - write < bytes ? ringSize - write : bytes;
+    memcpy(ringBuffer + write, pcmBuffer, chunk);
+    memcpy(ringBuffer, (char*) pcmBuffer + chunk, bytes - chunk);
+    ringFill += bytes;
+    pthread_cond_signal(&ringCond);
+  }
+  pthread_mutex_unlock(&ringLock);
+
+  audio_core_pace(decodeLen);
+}
+
+static int wav_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
+  char* filename = (char*) context;
+  int rc;
+  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, opusConfig->mapping, &rc);
+  if (decoder == NULL) {
+    printf("Failed to create Opus decoder: %d\n", rc);
+    return -1;
+  }
+
+  samplesPerFrame = opusConfig->samplesPerFrame;
+  channelCount = opusConfig->channelCount;
+  sampleRate = opusConfig->sampleRate;
+  pcmBuffer = malloc(sizeof(short) * channelCount * samplesPerFrame);
+  ringSize = sizeof(short) * channelCount * (sampleRate * WAV_BUFFER_MS / 1000);
+  ringBuffer = malloc(ringSize);
+  if (pcmBuffer == NULL || ringBuffer == NULL)
+    return -1;
+
+  wavFile = fopen(filename, "wb");
+  if (wavFile == NULL) {
+    fprintf(stderr, "Can't open audio file %s\n", filename);
+    return -1;
+  }
+  // Sizes are filled in once the stream ends
+  wav_write_header(0);
+
+  ringRead = ringFill = 0;
+  dataBytes = lostBytes = 0;
+  stopping = false;
+  if (pthread_create(&writerThread, NULL, wav_writer_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to create audio writer thread\n");
+    return -1;
+  }
+  writerRunning = true;
+
+  return audio_core_start(opusConfig, wav_renderer_play);
+}
+
+static void wav_renderer_cleanup() {
+  audio_core_stop();
+
+  if (writerRunning) {
+    pthread_mutex_lock(&ringLock);
+    stopping = true;
+    pthread_cond_signal(&ringCond);
+    pthread_mutex_unlock(&ringLock);
+    pthread_join(writerThread, NULL);
+    writerRunning = false;
+  }
+
+  if (wavFile != NULL) {
+    fseek(wavFile, 0, SEEK_SET);
+    wav_write_header(dataBytes);
+    fclose(wavFile);
+    wavFile = NULL;
+    if (lostBytes > 0)
+      fprintf(stderr, "Audio file writer fell behind, lost %lu bytes\n", lostBytes);
+  }
+
+  if (decoder != NULL) {
+    opus_multistream_decoder_destroy(decoder);
+    decoder = NULL;
+  }
+
+  if (pcmBuffer != NULL) {
+    free(pcmBuffer);
+    pcmBuffer = NULL;
+  }
+
+  if (ringBuffer != NULL) {
+    free(ringBuffer);
+    ringBuffer = NULL;
+  }
+}
+
+AUDIO_RENDERER_CALLBACKS audio_callbacks_wav = {
+  .init = wav_renderer_init,
+  .cleanup = wav_renderer_cleanup,
+  .decodeAndPlaySample = audio_core_submit,
+  .capabilities = CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION,
+};
@@ -0,0 +1,144 @@
+#include "avsync.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Weight of a new sample in the smoothed latencies
+#define AVSYNC_SMOOTHING 16
+#define AVSYNC_INTERVAL_US 1000000
+// Intervals between two offset reports
+#define AVSYNC_REPORT_INTERVALS 5
+// Offsets below this are not worth a correction
+#define AVSYNC_DEADBAND_US 10000
+// Largest delay change per interval, so a correction never causes an audible gap
+#define AVSYNC_STEP_US 5000
+#define AVSYNC_MAX_DELAY_US 150000
+// A frame interval this much longer than the average shows up as a stutter
+#define AVSYNC_LATE_FACTOR 1.5
+
+bool avsyncAuto = false;
+bool avsyncReport = false;
+int avsyncDisplayDelayMs = 0;
+
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static double audioLatencyUs, videoLatencyUs;
+static bool haveAudio, haveVideo;
+static int64_t lastVideoArrival;
+static uint64_t lastUpdateUs;
+static int intervals;
+static atomic_int audioDelayUs;
+
+static long offsetSum, offsetCount;
+static int maxOffsetUs;
+
+// Compare pipeline depths by latency and stutter
+static uint64_t videoFrames, lateFrames, lastPresentUs;
+static uint64_t frameLatencySum, frameLatencyMax;
+static double frameIntervalUs;
+static uint64_t gpuWaits, gpuWaitSum, gpuWaitMax;
+
+uint64_t avsync_time_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline double avsync_smooth(double average, bool have, double sample) {
+  return have ? average + (sample - average) / AVSYNC_SMOOTHING : sample;
+}
+
+void avsync_audio_played(uint64_t arrivalUs, int deviceLatencyUs) {
+  uint64_t now = avsync_time_us();
+
+  pthread_mutex_lock(&syncLock);
+  audioLatencyUs = avsync_smooth(audioLatencyUs, haveAudio, (double) (now - arrivalUs) + deviceLatencyUs);
+  haveAudio = true;
+  pthread_mutex_unlock(&syncLock);
+}
+
+// Called with syncLock held once per interval
+static void avsync_update() {
+  // Positive when the picture comes out after the sound
+  int offset = (int) (videoLatencyUs - audioLatencyUs);
+  int delay = atomic_load(&audioDelayUs);
+
+  offsetSum += offset;
+  offsetCount++;
+  if ((offset < 0 ? -offset : offset) > (maxOffsetUs < 0 ? -maxOffsetUs : maxOffsetUs))
+    maxOffsetUs = offset;
+
+  // The measured audio latency already contains the delay, so this converges step by step
+  if (avsyncAuto && (offset > AVSYNC_DEADBAND_US || offset < -AVSYNC_DEADBAND_US)) {
+    delay += offset > AVSYNC_STEP_US ? AVSYNC_STEP_US : (offset < -AVSYNC_STEP_US ? -AVSYNC_STEP_US : offset);
+    if (delay < 0)
+      delay = 0;
+    else if (delay > AVSYNC_MAX_DELAY_US)
+      delay = AVSYNC_MAX_DELAY_US;
+    atomic_store(&audioDelayUs, delay);
+  }
+
+  if (avsyncReport && ++intervals % AVSYNC_REPORT_INTERVALS == 0)
+    printf("A/V sync: audio %.1f ms, video %.1f ms, offset %+.1f ms, audio delay %.1f ms\n",
+           audioLatencyUs / 1000, videoLatencyUs / 1000, offset / 1000.0, delay / 1000.0);
+}
+
+void avsync_video_presented(int64_t arrivalUs) {
+  avsync_video_presented_at(arrivalUs, avsync_time_us());
+}
+
+void avsync_video_presented_at(int64_t arrivalUs, uint64_t now) {
+  pthread_mutex_lock(&syncLock);
+  // Displays that present in a loop show the same frame more than once
+  if (arrivalUs > 0 && arrivalUs != lastVideoArrival && (uint64_t) arrivalUs <= now) {
+    lastVideoArrival = arrivalUs;
+    videoLatencyUs = avsync_smooth(videoLatencyUs, haveVideo, (double) (now - arrivalUs) + avsyncDisplayDelayMs * 1000);
+    haveVideo = true;
+
+    videoFrames++;
+    frameLatencySum += now - arrivalUs;
+    if (now - arrivalUs > frameLatencyMax)
+      frameLatencyMax = now - arrivalUs;
+    if (lastPresentUs > 0) {
+      double interval = now - lastPresentUs;
+      if (videoFrames > 2 && interval > frameIntervalUs * AVSYNC_LATE_FACTOR)
+        lateFrames++;
+      frameIntervalUs = avsync_smooth(frameIntervalUs, videoFrames > 2, interval);
+    }
+    lastPresentUs = now;
+
+    if (haveAudio && now - lastUpdateUs >= AVSYNC_INTERVAL_US) {
+      lastUpdateUs = now;
+      avsync_update();
+    }
+  }
+  pthread_mutex_unlock(&syncLock);
+}
+
+void avsync_video_gpu_waited(uint64_t waitUs) {
+  pthread_mutex_lock(&syncLock);
+  gpuWaits++;
+  gpuWaitSum += waitUs;
+  if (waitUs > gpuWaitMax)
+    gpuWaitMax = waitUs;
+  pthread_mutex_unlock(&syncLock);
+}
+
+int avsync_audio_delay_us() {
+  return atomic_load(&audioDelayUs);
+}
+
+void avsync_print_stats() {
+  pthread_mutex_lock(&syncLock);
+  if (videoFrames > 0)
+    printf("Video: %llu frames, latency avg %.1f ms, max %.1f ms, frame interval %.1f ms, %llu late frames\n",
+           (unsigned long long) videoFrames, (double) frameLatencySum / videoFrames / 1000, frameLatencyMax / 1000.0,
+           frameIntervalUs / 1000, (unsigned long long) lateFrames);
+  if (gpuWaits > 0)
+    printf("GPU wait: avg %.2f ms, max %.2f ms\n", (double) gpuWaitSum / gpuWaits / 1000, gpuWaitMax / 1000.0);
+  if (offsetCount > 0)
+    printf("A/V sync: offset avg %+.1f ms, max %+.1f ms, audio delay %.1f ms\n",
+           (double) offsetSum / offsetCount / 1000, maxOffsetUs / 1000.0, atomic_load(&audioDelayUs) / 1000.0);
+  pthread_mutex_unlock(&syncLock);
+}
@@ -0,0 +1,22 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set from main before the stream starts
+extern bool avsyncAuto;
+extern bool avsyncReport;
+extern int avsyncDisplayDelayMs;
+
+uint64_t avsync_time_us();
+
+// Both paths are measured from packet arrival to the moment it leaves the device,
+// video also counts frames that came late compared to the average frame interval
+void avsync_audio_played(uint64_t arrivalUs, int deviceLatencyUs);
+void avsync_video_presented(int64_t arrivalUs);
+// Same with the time the frame reached the screen, for displays that report it after the flip
+void avsync_video_presented_at(int64_t arrivalUs, uint64_t presentUs);
+// Time the display spent waiting for the gpu to finish drawing a frame
+void avsync_video_gpu_waited(uint64_t waitUs);
+
+// Extra hold time for audio packets when the video path is slower
+int avsync_audio_delay_us();
+void avsync_print_stats();
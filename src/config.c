@@ -66,7 +66,13 @@ static struct option long_options[] = {
   {"nosops", no_argument, NULL, 'l'},
   {"lessthreads", no_argument, NULL, 'L'},
   {"audio", required_argument, NULL, 'm'},
+  {"audiolatency", required_argument, NULL, 'A'},
+  {"avsync", no_argument, NULL, 'B'},
+  {"downmix", required_argument, NULL, 'D'},
+  {"displaydelay", required_argument, NULL, 'C'},
   {"modeset", no_argument, NULL, 'M'},
+  {"vrr", no_argument, NULL, 'V'},
+  {"buffers", required_argument, NULL, 'N'},
   {"localaudio", no_argument, NULL, 'n'},
   {"config", required_argument, NULL, 'o'},
   {"platform", required_argument, NULL, 'p'},
@@ -212,9 +218,27 @@ static void parse_argument(int c, char* value, PCONFIGURATION config) {
   case 'm':
     config->audio_device = value;
     break;
+  case 'A':
+    config->audio_latency = atoi(value);
+    break;
+  case 'B':
+    config->avsync = true;
+    break;
+  case 'D':
+    config->downmix = value;
+    break;
+  case 'C':
+    config->display_delay = atoi(value);
+    break;
   case 'M':
     config->modeset = true;
     break;
+  case 'V':
+    config->vrr = true;
+    break;
+  case 'N':
+    config->buffers = atoi(value);
+    break;
   case 'n':
     config->localaudio = true;
     break;
@@ -400,6 +424,18 @@ void config_save(char* filename, PCONFIGURATION config) {
     write_config_bool(fd, "viewonly", config->viewonly);
   if (config->rotate != 0)
     write_config_int(fd, "rotate", config->rotate);
+  if (config->audio_latency != 0)
+    write_config_int(fd, "audiolatency", config->audio_latency);
+  if (config->avsync)
+    write_config_bool(fd, "avsync", config->avsync);
+  if (config->downmix != NULL)
+    write_config_string(fd, "downmix", config->downmix);
+  if (config->display_delay != 0)
+    write_config_int(fd, "displaydelay", config->display_delay);
+  if (config->vrr)
+    write_config_bool(fd, "vrr", config->vrr);
+  if (config->buffers != 0)
+    write_config_int(fd, "buffers", config->buffers);
 
   if (strcmp(config->app, "Steam") != 0)
     write_config_string(fd, "app", config->app);
@@ -443,6 +479,10 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   config->address = NULL;
   config->config_file = NULL;
   config->audio_device = NULL;
+  config->audio_latency = 0;
+  config->downmix = NULL;
+  config->avsync = false;
+  config->display_delay = 0;
   config->filters = NULL;
   config->sops = true;
   config->localaudio = false;
@@ -453,6 +493,8 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   config->mouse_emulation = true;
   config->rotate = 0;
   config->modeset = false;
+  config->vrr = false;
+  config->buffers = 0;
   config->codec = CODEC_UNSPECIFIED;
   config->hdr = false;
   config->pin = 0;
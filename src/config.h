@@ -32,6 +32,10 @@ typedef struct _CONFIGURATION {
   char* mapping;
   char* platform;
   char* audio_device;
+  int audio_latency;
+  char* downmix;
+  bool avsync;
+  int display_delay;
   char* config_file;
   char key_dir[4096];
   char* filters;
@@ -58,6 +62,8 @@ typedef struct _CONFIGURATION {
   bool fill_resolution;
   bool less_threads;
   bool modeset;
+  bool vrr;
+  int buffers;
 } CONFIGURATION, *PCONFIGURATION;
 
 extern bool inputAdded;
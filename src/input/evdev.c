@@ -20,6 +20,7 @@
 #include "evdev.h"
 
 #include "keyboard.h"
+#include "latency.h"
 
 #include "../loop.h"
 
@@ -38,6 +39,7 @@
 #include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #ifdef __linux__
 #include <endian.h>
 #else
@@ -98,6 +100,9 @@ struct input_abs_parms {
 
 struct input_device {
   struct libevdev *dev;
+  Evdev_Source source;
+  Evdev_Source_Timing sourceTiming;
+  void *sourceData;
   bool is_keyboard;
   bool is_mouse;
   bool is_touchscreen;
@@ -107,6 +112,8 @@ struct input_device {
   int abs_map[ABS_CNT];
   int hats_state[3][2];
   int fd;
+  // Clock of the event timestamps, -1 when they can't be compared to ours
+  int clockId;
   char *path;
   char modifiers;
   #ifdef __linux__
@@ -152,6 +159,10 @@ struct input_device {
   struct timeval btnDownTime;
   short controllerId;
   int haptic_effect_id;
+  bool hapticPlaying;
+  bool hapticPending;
+  unsigned short lowFreqMotor, highFreqMotor;
+  unsigned short leftTriggerMotor, rightTriggerMotor;
   int buttonFlags;
   unsigned char leftTrigger, rightTrigger;
   short leftStickX, leftStickY;
@@ -190,6 +201,9 @@ static const int hat_constants[3][3] = {{HAT_UP | HAT_LEFT, HAT_UP, HAT_UP | HAT
 // Limited by number of bits in activeGamepadMask
 #define MAX_GAMEPADS 16
 
+// Rumble updates arriving within this window are merged into one EVIOCSFF
+#define RUMBLE_COALESCE_INTERVAL 8000 // microseconds
+
 LIST_HEAD(head_of_list, List_Node);
 static struct head_of_list first_node;
 static struct head_of_list *head_device = &first_node;
@@ -208,6 +222,13 @@ static bool mouseEmulationEnabled;
 
 static bool waitingToExitOnModifiersUp = false;
 
+// Guards the device list against the rumble callbacks and rumble thread
+static pthread_mutex_t rumbleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rumbleCond = PTHREAD_COND_INITIALIZER;
+static pthread_t rumbleThread;
+static bool rumbleThreadRunning = false;
+static bool rumblePending = false;
+
 int evdev_gamepads = 0;
 
 #define ACTION_MODIFIERS (MODIFIER_SHIFT|MODIFIER_ALT|MODIFIER_CTRL)
@@ -220,6 +241,8 @@ int evdev_gamepads = 0;
 static bool (*handler) (struct input_event*, struct input_device*);
 static int evdev_handle(int fd, void *data);
 static int mt_evdev_handle(int fd, void *data, int interval, uint32_t event, int slot);
+static void evdev_rumble_start();
+static void evdev_rumble_stop();
 
 struct {
   DIR *dir;
@@ -238,6 +261,35 @@ static int evdev_get_map(int* map, int length, int value) {
   return -1;
 }
 
+static int evdev_next_event(struct input_device *device, struct input_event *ev) {
+  if (device->source)
+    return device->source(device->sourceData, ev);
+  return libevdev_next_event(device->dev, LIBEVDEV_READ_FLAG_NORMAL, ev);
+}
+
+static inline uint64_t evdev_time_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Touch handlers pull more events themselves, so only the time outside nested calls is reported
+static bool evdev_handle_source_event(struct input_event *ev, struct input_device *device) {
+  static uint64_t nestedNs;
+
+  if (device->sourceTiming == NULL)
+    return handler(ev, device);
+
+  uint64_t outerNested = nestedNs;
+  nestedNs = 0;
+  uint64_t start = evdev_time_ns();
+  bool res = handler(ev, device);
+  uint64_t elapsed = evdev_time_ns() - start;
+  device->sourceTiming(device->sourceData, elapsed - nestedNs);
+  nestedNs = outerNested + elapsed;
+  return res;
+}
+
 static void fake_grab_window() {
   fakeGrab = true;
   sync_input_state(true);
@@ -358,6 +410,7 @@ static bool evdev_init_parms(struct input_device *dev, struct input_abs_parms *p
 static void evdev_remove_device(struct input_device *dis_device, const char *path, int opt) {
   // opt is 1 means remove all device
   struct List_Node *nodePtr = NULL;
+  pthread_mutex_lock(&rumbleLock);
   LIST_FOREACH(nodePtr, head_device, node) {
     struct input_device *device = (struct input_device*)nodePtr->data;
     if(((device) == dis_device && dis_device != NULL) || opt == 1 || (path != NULL && strcmp(device->path, path) == 0)) {  
@@ -366,11 +419,12 @@ static void evdev_remove_device(struct input_device *dis_device, const char *pat
         printf("Input device removed: %s (player %d)\n", libevdev_get_name(device->dev), device->controllerId + 1);
 
       // remove from loop first
-      loop_remove_fd(device->fd);
+      if (device->fd >= 0)
+        loop_remove_fd(device->fd);
 
       // drain all event
       struct input_event ev;
-      while (libevdev_next_event(device->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev) >= 0);
+      while (evdev_next_event(device, &ev) >= 0);
 
       // clear device
       if (device->controllerId >= 0) {
@@ -393,7 +447,8 @@ static void evdev_remove_device(struct input_device *dis_device, const char *pat
 
       free(device->path);
       libevdev_free(device->dev);
-      close(device->fd);
+      if (device->fd >= 0)
+        close(device->fd);
 
       // remove device
       LIST_REMOVE(nodePtr, node);
@@ -404,6 +459,7 @@ static void evdev_remove_device(struct input_device *dis_device, const char *pat
         break;
     }
   }
+  pthread_mutex_unlock(&rumbleLock);
 }
 
 static void evdev_remove_all(void) {
@@ -563,6 +619,11 @@ static void send_controller_arrival(struct input_device *dev) {
                                supportedButtonFlags, capabilities);
 }
 
+static void evdev_record_latency(struct input_device *dev, struct input_event *ev, enum input_latency_class type) {
+  if (dev->clockId >= 0)
+    input_latency_record(type, dev->clockId, ev->input_event_sec, ev->input_event_usec);
+}
+
 static bool evdev_mt_touchpad_handle_event(struct input_event *ev, struct input_device *dev) {
   bool needSpecialEvent = false;
 
@@ -777,6 +838,7 @@ static bool evdev_mt_touchpad_handle_event(struct input_event *ev, struct input_
         LiSendMouseMoveEvent(dev->mouseDeltaX, dev->mouseDeltaY);
         break;
       }
+      evdev_record_latency(dev, ev, INPUT_LATENCY_TOUCH);
       dev->mouseDeltaX = 0;
       dev->mouseDeltaY = 0;
     }
@@ -1094,15 +1156,18 @@ static bool evdev_handle_event(struct input_event *ev, struct input_device *dev)
         LiSendMouseMoveEvent(dev->mouseDeltaX, dev->mouseDeltaY);
         break;
       }
+      evdev_record_latency(dev, ev, dev->is_touchscreen ? INPUT_LATENCY_TOUCH : INPUT_LATENCY_MOUSE);
       dev->mouseDeltaX = 0;
       dev->mouseDeltaY = 0;
     }
     if (dev->mouseVScroll != 0) {
       LiSendScrollEvent(dev->mouseVScroll);
+      evdev_record_latency(dev, ev, INPUT_LATENCY_MOUSE);
       dev->mouseVScroll = 0;
     }
     if (dev->mouseHScroll != 0) {
       LiSendHScrollEvent(dev->mouseHScroll);
+      evdev_record_latency(dev, ev, INPUT_LATENCY_MOUSE);
       dev->mouseHScroll = 0;
     } 
     if (dev->gamepadModified) {
@@ -1123,8 +1188,10 @@ static bool evdev_handle_event(struct input_event *ev, struct input_device *dev)
         send_controller_arrival(dev);
       }
       // Send event only if mouse emulation is disabled.
-      if (dev->mouseEmulation == false)
+      if (dev->mouseEmulation == false) {
         LiSendMultiControllerEvent(dev->controllerId, assignedControllerIds, dev->buttonFlags, dev->leftTrigger, dev->rightTrigger, dev->leftStickX, dev->leftStickY, dev->rightStickX, dev->rightStickY);
+        evdev_record_latency(dev, ev, INPUT_LATENCY_GAMEPAD);
+      }
       dev->gamepadModified = false;
     }
     break;
@@ -1246,6 +1313,7 @@ static bool evdev_handle_event(struct input_event *ev, struct input_device *dev)
         keyrelease(ev->code);
       short code = 0x80 << 8 | keyCodes[ev->code];
       LiSendKeyboardEvent(code, ev->value?KEY_ACTION_DOWN:KEY_ACTION_UP, dev->modifiers);
+      evdev_record_latency(dev, ev, INPUT_LATENCY_KEYBOARD);
 
     } else {
       if (!isInputing)
@@ -1363,6 +1431,7 @@ static bool evdev_handle_event(struct input_event *ev, struct input_device *dev)
 
       if (mouseCode != 0) {
         LiSendMouseButtonEvent(ev->value?BUTTON_ACTION_PRESS:BUTTON_ACTION_RELEASE, mouseCode);
+        evdev_record_latency(dev, ev, INPUT_LATENCY_MOUSE);
         gamepadModified = false;
       } else if (gamepadCode != 0) {
         if (ev->value) {
@@ -1616,7 +1685,7 @@ static void evdev_drain(void) {
   struct List_Node *nodePtr = NULL;
   LIST_FOREACH(nodePtr, head_device, node) {
     struct input_event ev;
-    while (libevdev_next_event(((struct input_device *)nodePtr->data)->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev) >= 0);
+    while (evdev_next_event((struct input_device *)nodePtr->data, &ev) >= 0);
   }
 }
 
@@ -1634,10 +1703,10 @@ static int mt_evdev_handle(int fd, void *data, int interval, uint32_t event, int
   device->mtLastEvent |= event;
   while (times < interval) {
     struct input_event ev = {0};
-    rc = libevdev_next_event(device->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+    rc = evdev_next_event(device, &ev);
     switch (rc) {
     case LIBEVDEV_READ_STATUS_SUCCESS:
-      if (!handler(&ev, device)) {
+      if (!evdev_handle_source_event(&ev, device)) {
         res = EXIT_RES;
         goto direct_exit;
       }
@@ -1712,13 +1781,13 @@ static int evdev_handle(int fd, void *data) {
   struct input_device *device = (struct input_device *)data;
   int rc;
   struct input_event ev;
-  while ((rc = libevdev_next_event(device->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev)) >= 0) {
+  while ((rc = evdev_next_event(device, &ev)) >= 0) {
     if (rc == LIBEVDEV_READ_STATUS_SYNC)
       fprintf(stderr, "Error:%s cannot keep up\n", libevdev_get_name(device->dev));
     else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
       if (!isInputing && ev.type != EV_KEY)
         break;
-      if (!handler(&ev, device)) {
+      if (!evdev_handle_source_event(&ev, device)) {
         return LOOP_RETURN;
       }
     }
@@ -1779,16 +1848,7 @@ void evdev_init_vars(bool isfakegrab, bool issdlgp, bool isswapxyab, bool isinpu
   return;
 }
 
-void evdev_create(const char* device, struct mapping* mappings, bool verbose, int rotate) {
-  int fd = open(device, O_RDWR|O_NONBLOCK);
-  if (fd <= 0) {
-    fprintf(stderr, "Failed to open device %s\n", device);
-    fflush(stderr);
-    return;
-  }
-
-  struct libevdev *evdev = libevdev_new();
-  libevdev_set_fd(evdev, fd);
+static struct input_device* evdev_add(struct libevdev *evdev, int fd, const char* device, struct mapping* mappings, bool verbose, int rotate) {
   const char* name = libevdev_get_name(evdev);
 
   int16_t guid[8] = {0};
@@ -1872,8 +1932,9 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
     if (verbose)
       printf("Skip acpibutton: %s\n", name);
     libevdev_free(evdev);
-    close(fd);
-    return;
+    if (fd >= 0)
+      close(fd);
+    return NULL;
   }
   // In some cases,Do not grab likekeyboard for avoiding keyboard unresponsive
   if (is_likekeyboard) {
@@ -1888,8 +1949,9 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
       if (verbose)
         printf("Ignoring gamepad by evdev,instead by using sdl: %s\n", name);
       libevdev_free(evdev);
-      close(fd);
-      return;
+      if (fd >= 0)
+        close(fd);
+      return NULL;
     }
 
     if (mappings == NULL) {
@@ -1912,8 +1974,9 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
           struct input_device *device_ptr = (struct input_device *)tmpnodePtr->data;
           if (strcmp(device_ptr->path, device) == 0) {
             libevdev_free(evdev);
-            close(fd);
-            return;
+            if (fd >= 0)
+              close(fd);
+            return NULL;
           }
         }
       }
@@ -1943,11 +2006,17 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
   numDevices++;
 
   memset(nodePtr, 0, sizeof(struct List_Node));
+  memset(dev, 0, sizeof(struct input_device));
+  dev->controllerId = -1;
   nodePtr->data = (void *) dev;
+  pthread_mutex_lock(&rumbleLock);
   LIST_INSERT_HEAD(head_device, nodePtr, node);
+  pthread_mutex_unlock(&rumbleLock);
 
-  memset(dev, 0, sizeof(struct input_device));
   dev->fd = fd;
+  dev->clockId = -1;
+  if (fd >= 0)
+    dev->clockId = libevdev_set_clock_id(evdev, CLOCK_MONOTONIC) == 0 ? CLOCK_MONOTONIC : CLOCK_REALTIME;
   dev->path = malloc(1 + strlen(device) * sizeof(char));
   memcpy(dev->path, device, 1 + strlen(device) * sizeof(char));
   dev->dev = evdev;
@@ -2029,7 +2098,37 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
     }
   }
 
-  loop_add_fd1(dev->fd, &evdev_handle, &evdev_remove_handle, 0, (void *)(dev));
+  if (dev->fd >= 0)
+    loop_add_fd1(dev->fd, &evdev_handle, &evdev_remove_handle, 0, (void *)(dev));
+
+  return dev;
+}
+
+void evdev_create(const char* device, struct mapping* mappings, bool verbose, int rotate) {
+  int fd = open(device, O_RDWR|O_NONBLOCK);
+  if (fd <= 0) {
+    fprintf(stderr, "Failed to open device %s\n", device);
+    fflush(stderr);
+    return;
+  }
+
+  struct libevdev *evdev = libevdev_new();
+  libevdev_set_fd(evdev, fd);
+  evdev_add(evdev, fd, device, mappings, verbose, rotate);
+}
+
+void* evdev_create_from_source(struct libevdev *evdev, const char* path, Evdev_Source source, Evdev_Source_Timing timing, void *data, struct mapping* mappings, bool verbose, int rotate) {
+  struct input_device *dev = evdev_add(evdev, -1, path, mappings, verbose, rotate);
+  if (dev) {
+    dev->source = source;
+    dev->sourceTiming = timing;
+    dev->sourceData = data;
+  }
+  return dev;
+}
+
+int evdev_dispatch(void *device) {
+  return evdev_handle(-1, device);
 }
 
 static void evdev_map_key(char* keyName, short* key) {
@@ -2164,6 +2263,7 @@ void evdev_start() {
 }
 
 void evdev_stop() {
+  evdev_rumble_stop();
   grab_window(E_UNGRAB_WINDOW);
   evdev_remove_all();
   monitor_input_dir_stop();
@@ -2172,6 +2272,7 @@ void evdev_stop() {
 void evdev_init(bool mouse_emulation_enabled) {
   handler = evdev_handle_event;
   mouseEmulationEnabled = mouse_emulation_enabled;
+  evdev_rumble_start();
 }
 
 static struct input_device* evdev_get_input_device(unsigned short controller_id) {
@@ -2185,34 +2286,134 @@ static struct input_device* evdev_get_input_device(unsigned short controller_id)
   return NULL;
 }
 
-void evdev_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
-  struct input_device* device = evdev_get_input_device(controller_id);
-  if (!device)
-    return;
-
-  if (device->haptic_effect_id >= 0) {
-    ioctl(device->fd, EVIOCRMFF, device->haptic_effect_id);
-    device->haptic_effect_id = -1;
-  }
+static void evdev_rumble_apply(struct input_device *device) {
+  // evdev has no separate trigger motors, so trigger rumble drives the main ones
+  unsigned short strong = device->lowFreqMotor > device->leftTriggerMotor ? device->lowFreqMotor : device->leftTriggerMotor;
+  unsigned short weak = device->highFreqMotor > device->rightTriggerMotor ? device->highFreqMotor : device->rightTriggerMotor;
+  struct input_event event = {0};
+  event.type = EV_FF;
 
-  if (low_freq_motor == 0 && high_freq_motor == 0)
+  if (strong == 0 && weak == 0) {
+    if (device->hapticPlaying) {
+      event.code = device->haptic_effect_id;
+      event.value = 0;
+      write(device->fd, (const void*) &event, sizeof(event));
+      device->hapticPlaying = false;
+    }
     return;
+  }
 
+  // Passing the id of an uploaded effect updates it in place
   struct ff_effect effect = {0};
   effect.type = FF_RUMBLE;
-  effect.id = -1;
+  effect.id = device->haptic_effect_id;
   effect.replay.length = USHRT_MAX;
-  effect.u.rumble.strong_magnitude = low_freq_motor;
-  effect.u.rumble.weak_magnitude = high_freq_motor;
-  if (ioctl(device->fd, EVIOCSFF, &effect) == -1)
-    return;
+  effect.u.rumble.strong_magnitude = strong;
+  effect.u.rumble.weak_magnitude = weak;
+  if (ioctl(device->fd, EVIOCSFF, &effect) == -1) {
+    if (device->haptic_effect_id < 0)
+      return;
 
-  struct input_event event = {0};
-  event.type = EV_FF;
-  event.code = effect.id;
-  event.value = 1;
-  write(device->fd, (const void*) &event, sizeof(event));
+    // The driver dropped our effect, upload a new one
+    effect.id = -1;
+    device->hapticPlaying = false;
+    if (ioctl(device->fd, EVIOCSFF, &effect) == -1) {
+      device->haptic_effect_id = -1;
+      return;
+    }
+  }
   device->haptic_effect_id = effect.id;
+
+  if (!device->hapticPlaying) {
+    event.code = effect.id;
+    event.value = 1;
+    write(device->fd, (const void*) &event, sizeof(event));
+    device->hapticPlaying = true;
+  }
+}
+
+static void *evdev_rumble_thread(void *param) {
+  pthread_mutex_lock(&rumbleLock);
+  while (rumbleThreadRunning) {
+    if (!rumblePending) {
+      pthread_cond_wait(&rumbleCond, &rumbleLock);
+      continue;
+    }
+
+    rumblePending = false;
+    struct List_Node *nodePtr = NULL;
+    LIST_FOREACH(nodePtr, head_device, node) {
+      struct input_device *device = (struct input_device *)nodePtr->data;
+      if (device->hapticPending) {
+        device->hapticPending = false;
+        evdev_rumble_apply(device);
+      }
+    }
+
+    // Only the latest magnitudes received during this interval are applied
+    pthread_mutex_unlock(&rumbleLock);
+    usleep(RUMBLE_COALESCE_INTERVAL);
+    pthread_mutex_lock(&rumbleLock);
+  }
+  pthread_mutex_unlock(&rumbleLock);
+
+  return NULL;
+}
+
+static void evdev_rumble_schedule(struct input_device *device) {
+  if (!rumbleThreadRunning) {
+    evdev_rumble_apply(device);
+    return;
+  }
+
+  device->hapticPending = true;
+  rumblePending = true;
+  pthread_cond_signal(&rumbleCond);
+}
+
+static void evdev_rumble_start() {
+  pthread_mutex_lock(&rumbleLock);
+  if (!rumbleThreadRunning) {
+    rumbleThreadRunning = true;
+    if (pthread_create(&rumbleThread, NULL, evdev_rumble_thread, NULL) != 0) {
+      fprintf(stderr, "Can't create rumble thread, rumble updates will not be coalesced\n");
+      rumbleThreadRunning = false;
+    }
+  }
+  pthread_mutex_unlock(&rumbleLock);
+}
+
+static void evdev_rumble_stop() {
+  pthread_mutex_lock(&rumbleLock);
+  bool running = rumbleThreadRunning;
+  rumbleThreadRunning = false;
+  pthread_cond_signal(&rumbleCond);
+  pthread_mutex_unlock(&rumbleLock);
+
+  if (running)
+    pthread_join(rumbleThread, NULL);
+}
+
+void evdev_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
+  pthread_mutex_lock(&rumbleLock);
+  struct input_device* device = evdev_get_input_device(controller_id);
+  if (device) {
+    device->lowFreqMotor = low_freq_motor;
+    device->highFreqMotor = high_freq_motor;
+    evdev_rumble_schedule(device);
+  }
+  pthread_mutex_unlock(&rumbleLock);
+}
+
+void evdev_rumble_triggers(unsigned short controller_id, unsigned short left_trigger, unsigned short right_trigger) {
+  pthread_mutex_lock(&rumbleLock);
+  struct input_device* device = evdev_get_input_device(controller_id);
+  if (device) {
+    device->leftTriggerMotor = left_trigger;
+    device->rightTriggerMotor = right_trigger;
+    evdev_rumble_schedule(device);
+  }
+  pthread_mutex_unlock(&rumbleLock);
 }
 
 void sync_input_state(bool isinputing) {
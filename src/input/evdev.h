@@ -19,6 +19,8 @@
 
 #include "mapping.h"
 
+#include <stdint.h>
+
 #define EVDEV_HANDLE_BY_WINDOW 1
 #define EVDEV_HANDLE_BY_EVDEV 0
 
@@ -26,9 +28,19 @@ typedef int evwcode;
 enum evWindowCode { VTF1CODE = 1, VTF2CODE, VTF3CODE, VTF4CODE, VTF5CODE, VTF6CODE, VTF7CODE, VTF8CODE, VTF9CODE, VTFACODE, VTFBCODE, VTFCCODE, QUITCODE, GRABCODE, UNGRABCODE, FAKEGRABCODE, UNFAKEGRABCODE, FROMDISPLAY = 128 };
 enum grabWindowRequest {E_STOP_INPUT = -1, E_UNGRAB_WINDOW, E_GRAB_WINDOW};
 
+struct libevdev;
+struct input_event;
+
+// Injected event source, same return convention as libevdev_next_event
+typedef int(*Evdev_Source)(void *data, struct input_event *ev);
+// Optional, gets the time the handlers spent on each injected event
+typedef void(*Evdev_Source_Timing)(void *data, uint64_t ns);
+
 extern int evdev_gamepads;
 
 void evdev_create(const char* device, struct mapping* mappings, bool verbose, int rotate);
+void* evdev_create_from_source(struct libevdev *evdev, const char* path, Evdev_Source source, Evdev_Source_Timing timing, void *data, struct mapping* mappings, bool verbose, int rotate);
+int evdev_dispatch(void *device);
 void evdev_remove_from_path(const char* path);
 void evdev_loop();
 
@@ -37,6 +49,7 @@ void evdev_start();
 void evdev_stop();
 void evdev_map(char* device);
 void evdev_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor);
+void evdev_rumble_triggers(unsigned short controller_id, unsigned short left_trigger, unsigned short right_trigger);
 void evdev_trans_op_fd(int fd);
 void evdev_init_vars(bool isfakegrab, bool issdlgp, bool isswapxyab, bool isinputadded, struct mapping* mappings, int rotate);
 void grab_window(enum grabWindowRequest request);
@@ -0,0 +1,101 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Bucket n holds samples in [2^n, 2^(n+1)) us, the last one everything above
+#define LATENCY_BUCKETS 20
+// Samples further away than this come from another clock base
+#define LATENCY_MAX_US 10000000
+
+struct latency_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t invalid;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+static const char* latency_class_names[INPUT_LATENCY_CLASSES] = { "keyboard", "mouse", "gamepad", "touch" };
+
+static struct latency_histogram histograms[INPUT_LATENCY_CLASSES];
+static pthread_mutex_t latencyLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void latency_add(enum input_latency_class type, int64_t us) {
+  struct latency_histogram *hist = &histograms[type];
+
+  pthread_mutex_lock(&latencyLock);
+  if (us < 0 || us > LATENCY_MAX_US) {
+    hist->invalid++;
+  } else {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (us >> (bucket + 1)) > 0)
+      bucket++;
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += us;
+    if (us > hist->max)
+      hist->max = us;
+  }
+  pthread_mutex_unlock(&latencyLock);
+}
+
+void input_latency_record(enum input_latency_class type, clockid_t clock, long sec, long usec) {
+  struct timespec now;
+  if (clock_gettime(clock, &now) < 0)
+    return;
+
+  latency_add(type, ((int64_t) now.tv_sec - sec) * 1000000 + now.tv_nsec / 1000 - usec);
+}
+
+void input_latency_record_us(enum input_latency_class type, uint64_t time_us) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  latency_add(type, (int64_t) ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 - time_us));
+}
+
+void input_latency_record_ms(enum input_latency_class type, uint32_t time_ms) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  // Millisecond timestamps wrap around every ~49 days
+  uint32_t now_ms = (uint32_t) ((uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+  int32_t diff = (int32_t) (now_ms - time_ms);
+  latency_add(type, (int64_t) diff * 1000);
+}
+
+void input_latency_print() {
+  bool header = false;
+
+  pthread_mutex_lock(&latencyLock);
+  for (int i = 0; i < INPUT_LATENCY_CLASSES; i++) {
+    struct latency_histogram *hist = &histograms[i];
+    if (hist->count == 0 && hist->invalid == 0)
+      continue;
+
+    if (!header) {
+      printf("Input latency (event timestamp to send):\n");
+      header = true;
+    }
+
+    printf("  %s: %llu events, avg %llu us, max %llu us", latency_class_names[i], (unsigned long long) hist->count,
+           (unsigned long long) (hist->count > 0 ? hist->sum / hist->count : 0), (unsigned long long) hist->max);
+    if (hist->invalid > 0)
+      printf(", %llu without usable timestamp", (unsigned long long) hist->invalid);
+    printf("\n");
+
+    for (int j = 0; j < LATENCY_BUCKETS; j++) {
+      if (hist->buckets[j] == 0)
+        continue;
+
+      if (j == LATENCY_BUCKETS - 1)
+        printf("    >= %d us: %llu\n", 1 << j, (unsigned long long) hist->buckets[j]);
+      else
+        printf("    %d-%d us: %llu\n", j == 0 ? 0 : 1 << j, (1 << (j + 1)) - 1, (unsigned long long) hist->buckets[j]);
+    }
+  }
+  pthread_mutex_unlock(&latencyLock);
+}
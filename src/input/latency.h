@@ -0,0 +1,10 @@
+#include <stdint.h>
+#include <time.h>
+
+enum input_latency_class { INPUT_LATENCY_KEYBOARD, INPUT_LATENCY_MOUSE, INPUT_LATENCY_GAMEPAD, INPUT_LATENCY_TOUCH, INPUT_LATENCY_CLASSES };
+
+// Time from the kernel/compositor event timestamp to the matching LiSend* call
+void input_latency_record(enum input_latency_class type, clockid_t clock, long sec, long usec);
+void input_latency_record_us(enum input_latency_class type, uint64_t time_us);
+void input_latency_record_ms(enum input_latency_class type, uint32_t time_ms);
+void input_latency_print();
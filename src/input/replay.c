@@ -0,0 +1,301 @@
+#include "../loop.h"
+#include "../util.h"
+
+#include "replay.h"
+#include "evdev.h"
+
+#include "libevdev/libevdev.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define REPLAY_MAX_LINE 4096
+
+struct replay_source {
+  struct input_event *events;
+  size_t eventsSize;
+  int count;
+  int pos;
+  int frames;
+  int timed;
+  uint64_t *latency;
+};
+
+static bool replayLogging = false;
+
+static inline uint64_t replay_diff_ns(struct timespec *start, struct timespec *end) {
+  return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000 + end->tv_nsec - start->tv_nsec;
+}
+
+// Events are handed out back to back, a real device would only make the handlers wait
+static int replay_next_event(void *data, struct input_event *ev) {
+  struct replay_source *src = (struct replay_source *)data;
+  if (src->pos >= src->count)
+    return -EAGAIN;
+
+  *ev = src->events[src->pos++];
+  if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+    src->frames++;
+  return LIBEVDEV_READ_STATUS_SUCCESS;
+}
+
+static void replay_event_handled(void *data, uint64_t ns) {
+  struct replay_source *src = (struct replay_source *)data;
+  if (src->timed < src->count)
+    src->latency[src->timed++] = ns;
+}
+
+// Parse an evemu-record text file into a libevdev description and an event list
+static int replay_parse(FILE *fp, struct libevdev *evdev, struct replay_source *src) {
+  static unsigned char bits[EV_CNT][KEY_CNT / 8];
+  static struct input_absinfo absinfo[ABS_CNT];
+  int bitsOffset[EV_CNT] = {0};
+  int propOffset = 0;
+  char line[REPLAY_MAX_LINE];
+
+  memset(bits, 0, sizeof(bits));
+  memset(absinfo, 0, sizeof(absinfo));
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned int type, code, bustype, vendor, product, version, mask;
+    long sec, usec;
+    int value, consumed;
+    char *ptr;
+
+    switch (line[0]) {
+    case 'N':
+      if (strncmp(line, "N: ", 3) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        libevdev_set_name(evdev, line + 3);
+      }
+      break;
+    case 'I':
+      if (sscanf(line, "I: %x %x %x %x", &bustype, &vendor, &product, &version) == 4) {
+        libevdev_set_id_bustype(evdev, bustype);
+        libevdev_set_id_vendor(evdev, vendor);
+        libevdev_set_id_product(evdev, product);
+        libevdev_set_id_version(evdev, version);
+      }
+      break;
+    case 'P':
+      ptr = line + 2;
+      while (sscanf(ptr, "%x%n", &mask, &consumed) == 1) {
+        for (int bit = 0; bit < 8; bit++) {
+          if ((mask & (1 << bit)) && propOffset * 8 + bit <= INPUT_PROP_MAX)
+            libevdev_enable_property(evdev, propOffset * 8 + bit);
+        }
+        propOffset++;
+        ptr += consumed;
+      }
+      break;
+    case 'B':
+      if (sscanf(line, "B: %x%n", &type, &consumed) != 1 || type >= EV_CNT)
+        break;
+      ptr = line + consumed;
+      while (sscanf(ptr, "%x%n", &mask, &consumed) == 1) {
+        if (bitsOffset[type] < (int)sizeof(bits[type]))
+          bits[type][bitsOffset[type]++] = mask;
+        ptr += consumed;
+      }
+      break;
+    case 'A':
+      if (sscanf(line, "A: %x", &code) != 1 || code >= ABS_CNT)
+        break;
+      // Resolution is missing in old evemu files
+      sscanf(line, "A: %*x %d %d %d %d %d", &absinfo[code].minimum, &absinfo[code].maximum,
+             &absinfo[code].fuzz, &absinfo[code].flat, &absinfo[code].resolution);
+      break;
+    case 'E':
+      if (sscanf(line, "E: %ld.%ld %x %x %d", &sec, &usec, &type, &code, &value) != 5)
+        break;
+      if ((src->count + 1) * sizeof(struct input_event) > src->eventsSize)
+        ensure_buf_size((void **)&src->events, &src->eventsSize, 2 * src->eventsSize + 256 * sizeof(struct input_event));
+      struct input_event *ev = &src->events[src->count++];
+      memset(ev, 0, sizeof(*ev));
+      ev->input_event_sec = sec;
+      ev->input_event_usec = usec;
+      ev->type = type;
+      ev->code = code;
+      ev->value = value;
+      break;
+    }
+  }
+
+  // Type 0 lists the supported event types, the other types list their codes
+  for (unsigned int type = 1; type < EV_CNT; type++) {
+    if ((bits[0][type / 8] & (1 << (type % 8))) == 0 || type == EV_REP)
+      continue;
+    libevdev_enable_event_type(evdev, type);
+    for (unsigned int code = 0; code < sizeof(bits[type]) * 8; code++) {
+      if ((bits[type][code / 8] & (1 << (code % 8))) == 0)
+        continue;
+      libevdev_enable_event_code(evdev, type, code, type == EV_ABS && code < ABS_CNT ? &absinfo[code] : NULL);
+    }
+  }
+
+  return src->count > 0 ? 0 : -1;
+}
+
+static int replay_compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void replay_print_stats(const char* file, struct replay_source *src, uint64_t total) {
+  if (src->timed == 0)
+    return;
+
+  uint64_t sum = 0;
+  for (int i = 0; i < src->timed; i++)
+    sum += src->latency[i];
+  qsort(src->latency, src->timed, sizeof(uint64_t), replay_compare);
+
+  fprintf(stderr, "Replayed %s: %d events, %d frames in %.3f ms (%.0f events/s)\n", file, src->pos, src->frames,
+          total / 1000000.0, total ? src->pos * 1000000000.0 / total : 0);
+  fprintf(stderr, "Per-event latency: avg %.2f us, p50 %.2f us, p99 %.2f us, max %.2f us\n",
+          sum / 1000.0 / src->timed,
+          src->latency[src->timed / 2] / 1000.0,
+          src->latency[(src->timed - 1) * 99 / 100] / 1000.0,
+          src->latency[src->timed - 1] / 1000.0);
+}
+
+int evdev_replay(const char* file, struct mapping* mappings, bool verbose, int rotate) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Can't open replay file: %s\n", file);
+    return -1;
+  }
+
+  struct replay_source src = {0};
+  struct libevdev *evdev = libevdev_new();
+  int ret = replay_parse(fp, evdev, &src);
+  fclose(fp);
+  if (ret < 0) {
+    fprintf(stderr, "No events found in replay file: %s\n", file);
+    libevdev_free(evdev);
+    free(src.events);
+    return -1;
+  }
+
+  src.latency = calloc(src.count, sizeof(uint64_t));
+  if (src.latency == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  void *device = evdev_create_from_source(evdev, file, &replay_next_event, &replay_event_handled, &src, mappings, verbose, rotate);
+  if (device == NULL) {
+    free(src.latency);
+    free(src.events);
+    return -1;
+  }
+
+  struct timespec start, end;
+  replayLogging = true;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (src.pos < src.count) {
+    ret = evdev_dispatch(device);
+    if (ret == LOOP_RETURN) {
+      printf("Replay of %s stopped by quit combination\n", file);
+      break;
+    } else if (ret == LOOP_REMOVE) {
+      device = NULL;
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  replayLogging = false;
+
+  if (device != NULL)
+    evdev_remove_from_path(file);
+
+  replay_print_stats(file, &src, replay_diff_ns(&start, &end));
+
+  free(src.latency);
+  free(src.events);
+  return 0;
+}
+
+#ifdef HAVE_REPLAY_LOG
+// Linked with -Wl,--wrap so the calls made by the input handlers can be logged
+int __real_LiSendMouseMoveEvent(short deltaX, short deltaY);
+int __real_LiSendMouseButtonEvent(char action, int button);
+int __real_LiSendKeyboardEvent(short keyCode, char keyAction, char modifiers);
+int __real_LiSendScrollEvent(signed char scrollClicks);
+int __real_LiSendHScrollEvent(signed char scrollClicks);
+int __real_LiSendHighResScrollEvent(short scrollAmount);
+int __real_LiSendHighResHScrollEvent(short scrollAmount);
+int __real_LiSendMultiControllerEvent(short controllerNumber, short activeGamepadMask, int buttonFlags, unsigned char leftTrigger, unsigned char rightTrigger,
+                                      short leftStickX, short leftStickY, short rightStickX, short rightStickY);
+int __real_LiSendControllerArrivalEvent(uint8_t controllerNumber, uint16_t activeGamepadMask, uint8_t type, uint32_t supportedButtonFlags, uint16_t capabilities);
+
+int __wrap_LiSendMouseMoveEvent(short deltaX, short deltaY) {
+  if (!replayLogging)
+    return __real_LiSendMouseMoveEvent(deltaX, deltaY);
+  printf("LiSendMouseMoveEvent %d %d\n", deltaX, deltaY);
+  return 0;
+}
+
+int __wrap_LiSendMouseButtonEvent(char action, int button) {
+  if (!replayLogging)
+    return __real_LiSendMouseButtonEvent(action, button);
+  printf("LiSendMouseButtonEvent %d %d\n", action, button);
+  return 0;
+}
+
+int __wrap_LiSendKeyboardEvent(short keyCode, char keyAction, char modifiers) {
+  if (!replayLogging)
+    return __real_LiSendKeyboardEvent(keyCode, keyAction, modifiers);
+  printf("LiSendKeyboardEvent 0x%04x %d 0x%02x\n", (unsigned short)keyCode, keyAction, (unsigned char)modifiers);
+  return 0;
+}
+
+int __wrap_LiSendScrollEvent(signed char scrollClicks) {
+  if (!replayLogging)
+    return __real_LiSendScrollEvent(scrollClicks);
+  printf("LiSendScrollEvent %d\n", scrollClicks);
+  return 0;
+}
+
+int __wrap_LiSendHScrollEvent(signed char scrollClicks) {
+  if (!replayLogging)
+    return __real_LiSendHScrollEvent(scrollClicks);
+  printf("LiSendHScrollEvent %d\n", scrollClicks);
+  return 0;
+}
+
+int __wrap_LiSendHighResScrollEvent(short scrollAmount) {
+  if (!replayLogging)
+    return __real_LiSendHighResScrollEvent(scrollAmount);
+  printf("LiSendHighResScrollEvent %d\n", scrollAmount);
+  return 0;
+}
+
+int __wrap_LiSendHighResHScrollEvent(short scrollAmount) {
+  if (!replayLogging)
+    return __real_LiSendHighResHScrollEvent(scrollAmount);
+  printf("LiSendHighResHScrollEvent %d\n", scrollAmount);
+  return 0;
+}
+
+int __wrap_LiSendMultiControllerEvent(short controllerNumber, short activeGamepadMask, int buttonFlags, unsigned char leftTrigger, unsigned char rightTrigger,
+                                      short leftStickX, short leftStickY, short rightStickX, short rightStickY) {
+  if (!replayLogging)
+    return __real_LiSendMultiControllerEvent(controllerNumber, activeGamepadMask, buttonFlags, leftTrigger, rightTrigger, leftStickX, leftStickY, rightStickX, rightStickY);
+  printf("LiSendMultiControllerEvent %d 0x%x 0x%x %d %d %d %d %d %d\n", controllerNumber, (unsigned short)activeGamepadMask, buttonFlags,
+         leftTrigger, rightTrigger, leftStickX, leftStickY, rightStickX, rightStickY);
+  return 0;
+}
+
+int __wrap_LiSendControllerArrivalEvent(uint8_t controllerNumber, uint16_t activeGamepadMask, uint8_t type, uint32_t supportedButtonFlags, uint16_t capabilities) {
+  if (!replayLogging)
+    return __real_LiSendControllerArrivalEvent(controllerNumber, activeGamepadMask, type, supportedButtonFlags, capabilities);
+  printf("LiSendControllerArrivalEvent %d 0x%x %d 0x%x 0x%x\n", controllerNumber, activeGamepadMask, type, supportedButtonFlags, capabilities);
+  return 0;
+}
+#endif
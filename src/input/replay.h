@@ -0,0 +1,3 @@
+#include "mapping.h"
+
+int evdev_replay(const char* file, struct mapping* mappings, bool verbose, int rotate);
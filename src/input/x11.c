@@ -26,6 +26,7 @@
 #include "x11.h"
 #include "evdev.h"
 #include "keyboard.h"
+#include "latency.h"
 
 #include "../loop.h"
 
@@ -154,8 +155,10 @@ static int x11_handler(int fd, void *data) {
       motion_y = event.xmotion.y - last_y;
       if (abs(motion_x) > 0 || abs(motion_y) > 0) {
         if (last_x >= 0 && last_y >= 0 && inputing) {
-          if (!grabbed)
+          if (!grabbed) {
             LiSendMouseMoveAsMousePositionEvent(motion_x, motion_y, x_display_width, x_display_height);
+            input_latency_record_ms(INPUT_LATENCY_MOUSE, event.xmotion.time);
+          }
 /*
           // handled by evdev instead
           if (grabbed)
@@ -25,10 +25,13 @@
 
 #include "audio/audio.h"
 #include "video/video.h"
+#include "avsync.h"
 
 #include "input/mapping.h"
 #include "input/evdev.h"
 #include "input/udev.h"
+#include "input/replay.h"
+#include "input/latency.h"
 #ifdef HAVE_LIBCEC
 #include "input/cec.h"
 #endif
@@ -119,6 +122,8 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
     drFlags |= FILL_RESOLUTION;
   if (config->modeset)
     drFlags |= MODESET;
+  if (config->vrr)
+    drFlags |= VRR;
 
   switch (config->rotate) {
   case 0:
@@ -202,6 +207,12 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
 
   LiStopConnection();
 
+  if (config->debug_level > 0) {
+    input_latency_print();
+    audio_core_print_stats();
+    avsync_print_stats();
+  }
+
   if (config->quitappafter) {
     if (config->debug_level > 0)
       printf("Sending app quit request ...\n");
@@ -227,6 +238,7 @@ static void help() {
   printf("\tlist\t\t\tList available games and applications\n");
   printf("\tquit\t\t\tQuit the application or game being streamed\n");
   printf("\tmap\t\t\tCreate mapping for gamepad\n");
+  printf("\treplay\t\t\tReplay evemu input recordings given with -input\n");
   printf("\thelp\t\t\tShow this help\n");
   printf("\n Global Options\n\n");
   printf("\t-config <config>\tLoad configuration file\n");
@@ -247,6 +259,8 @@ static void help() {
   printf("\t-packetsize <size>\tSpecify the maximum packetsize in bytes\n");
   printf("\t-codec <codec>\t\tSelect used codec: auto/h264/h265/av1 (default auto)\n");
   printf("\t-hdr \t\t\tEnable hdr support for wayland_vaapi/drm_vaapi/drm/wayland/vulkan platform\n");
+  printf("\t-vrr \t\t\tPresent frames immediately on vrr capable displays for drm/drm_vaapi platform\n");
+  printf("\t-buffers <2-6>\t\tNumber of video buffers between decoder and display (default 3)\n");
   printf("\t-yuv444\t\t\tTry to use yuv444 format\n");
   printf("\t-filters <filters>\tUse ffmpeg video filters to modify video\n");
   printf("\t-remote <yes/no/auto>\tEnable optimizations for WAN streaming (default auto)\n");
@@ -257,6 +271,10 @@ static void help() {
   printf("\t-app <app>\t\tName of app to stream\n");
   printf("\t-nosops\t\t\tDon't allow GFE to modify game settings\n");
   printf("\t-localaudio\t\tPlay audio locally on the host computer\n");
+  printf("\t-audiolatency <ms>\tDrop audio queued for longer than <ms> (default 200)\n");
+  printf("\t-avsync\t\t\tDelay audio to match the measured video latency\n");
+  printf("\t-downmix <weights>\tComma separated downmix weights, one row of input channels per output channel\n");
+  printf("\t-displaydelay <ms>\tAdd the video processing delay of the display to the measured video latency\n");
   printf("\t-surround <5.1/7.1>\tStream 5.1 or 7.1 surround sound\n");
   printf("\t-keydir <directory>\tLoad encryption keys from directory\n");
   printf("\t-mapping <file>\t\tUse <file> as gamepad mappings configuration file\n");
@@ -310,6 +328,27 @@ int main(int argc, char* argv[]) {
     exit(0);
   }
 
+  if (strcmp("replay", config.action) == 0) {
+    if (config.inputsCount < 1) {
+      printf("You need to specify at least one recording using -input.\n");
+      exit(-1);
+    }
+
+    struct mapping* mappings = NULL;
+    if (config.mapping != NULL)
+      mappings = mapping_load(config.mapping, config.debug_level > 0);
+
+    evdev_init_vars(config.fakegrab, false, config.swapxyab, true, mappings, config.rotate);
+    evdev_init(config.mouse_emulation);
+    int ret = 0;
+    for (int i=0;i<config.inputsCount;i++) {
+      if (evdev_replay(config.inputs[i], mappings, config.debug_level > 0, config.rotate) < 0)
+        ret = -1;
+    }
+    evdev_stop();
+    exit(ret);
+  }
+
   if (config.address == NULL) {
     config.address = malloc(MAX_ADDRESS_SIZE);
     if (config.address == NULL) {
@@ -364,6 +403,14 @@ int main(int argc, char* argv[]) {
     // set want hdr before system init,system must report hdr support by display
     wantYuv444 = config.yuv444 ? true : false;
     wantHdr = config.hdr ? true : false;
+    if (config.buffers > 0)
+      videoBufferNum = config.buffers;
+    videoCacheDir = config.key_dir;
+    audioLatencyCeiling = config.audio_latency;
+    audioDownmixMatrix = config.downmix;
+    avsyncAuto = config.avsync;
+    avsyncDisplayDelayMs = config.display_delay;
+    avsyncReport = config.debug_level > 0;
     enum platform system = platform_check(config.platform);
     if (config.debug_level > 0)
       printf("Platform %s\n", platform_name(system));
@@ -483,8 +530,10 @@ int main(int argc, char* argv[]) {
         udev_init(!inputAdded, mappings, config.debug_level > 0, config.rotate);
         evdev_init(config.mouse_emulation);
 
-        if (!config.sdlgp)
+        if (!config.sdlgp) {
           rumble_handler = evdev_rumble;
+          rumble_triggers_handler = evdev_rumble_triggers;
+        }
 
         #ifdef HAVE_LIBCEC
         cec_init();
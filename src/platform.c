@@ -194,7 +194,10 @@ DECODER_RENDERER_CALLBACKS* platform_get_video(enum platform system) {
 AUDIO_RENDERER_CALLBACKS* platform_get_audio(enum platform system, char* audio_device) {
   switch (system) {
   case FAKE:
-      return NULL;
+    // Decode anyway so headless runs still exercise the audio path
+    if (audio_device != NULL && audio_wav_file(audio_device))
+      return &audio_callbacks_wav;
+    return &audio_callbacks_null;
   #ifdef HAVE_PI
   case PI:
     if (audio_device == NULL || strcmp(audio_device, "local") == 0 || strcmp(audio_device, "hdmi") == 0)
@@ -202,6 +205,14 @@ AUDIO_RENDERER_CALLBACKS* platform_get_audio(enum platform system, char* audio_d
     // fall-through
   #endif
   default:
+    if (audio_device != NULL && strcmp(audio_device, "nullsink") == 0)
+      return &audio_callbacks_null;
+    if (audio_device != NULL && audio_wav_file(audio_device))
+      return &audio_callbacks_wav;
+    #ifdef HAVE_SDL
+    if (audio_device != NULL && strcmp(audio_device, "sdl") == 0)
+      return &audio_callbacks_sdl;
+    #endif
     #ifdef HAVE_PULSE
     if (audio_pulse_init(audio_device))
       return &audio_callbacks_pulse;
@@ -261,7 +272,7 @@ char* platform_name(enum platform system) {
   case X11_VULKAN:
     return "X Window System (VULKAN)";
   case FAKE:
-    return "Fake (no a/v output)";
+    return "Fake (no video output, audio to null or wav)";
   default:
     return "Unknown";
   }
@@ -1,5 +1,6 @@
 #include <libavutil/frame.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
 #if defined(HAVE_LIBYUV)
 #include <libyuv.h>
 #else
@@ -346,7 +347,13 @@ static int convert_frame_another(AVFrame * src_frame, uint8_t *dst_buffer[4], ui
 
 static int convert_frame_copy(AVFrame * src_frame, uint8_t *dst_buffer[4], uint32_t pitch[4], int dst_fmt) {
   for (int i = 0; i < planes; i++) {
-    memcpy(dst_buffer[i], src_frame->data[i], pitch[i] * (i == 0 ? src_frame->height : ((int)(src_frame->height / multi))));
+    int rows = i == 0 ? src_frame->height : ((int)(src_frame->height / multi));
+    // the buffer pitch rarely matches the decoder linesize, so copy row by row then
+    if ((int) pitch[i] == src_frame->linesize[i])
+      memcpy(dst_buffer[i], src_frame->data[i], pitch[i] * rows);
+    else
+      av_image_copy_plane(dst_buffer[i], pitch[i], src_frame->data[i], src_frame->linesize[i],
+                          FFMIN((int) pitch[i], src_frame->linesize[i]), rows);
   }
   return 0;
 }
@@ -56,6 +56,9 @@ struct DISPLAY_CALLBACK {
   void (*display_modify_window) (struct WINDOW_OP *oprate, int flags);
   int (*display_vsync_loop) (void *data, int width, int height, int index);
   void (*display_exported_buffer_info) (struct Source_Buffer_Info *buffer, int *buffersNum, int *planesNum);
+  // optional, images passed to display_vsync_loop are handed back through release once off the screen,
+  // presented gets them with the monotonic time in us they reached the screen
+  int (*display_set_release) (void (*release) (void *data), void (*presented) (void *data, uint64_t present_us));
   int renders;
 };
 
@@ -10,6 +10,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -56,6 +57,7 @@ struct _drm_render_config {
   int buffer_multi;
   int colorspace;
   int filter_action;
+  uint32_t rotate;
   AVFrame *frame;
   uint64_t size[MAX_FB_NUM][MAX_PLANE_NUM];
 } static drm_config = {0};
@@ -302,6 +304,20 @@ static uint32_t drm_generate_drm_buf (int drm_fd, int src_format, int width, int
   return format;
 }
 
+static double drm_mode_refresh (const drmModeModeInfo *mode) {
+  if (mode->htotal == 0 || mode->vtotal == 0)
+    return mode->vrefresh;
+  return mode->clock * 1000.0 / ((double)mode->htotal * mode->vtotal);
+}
+
+// frames per second shown for more or fewer vblanks than the cadence asks for
+static double drm_mode_judder (double refresh, int fps) {
+  int multi = (int)(refresh / fps + 0.5);
+  if (multi < 1)
+    multi = 1;
+  return fabs(refresh - multi * fps);
+}
+
 static int drm_setup(int width, int height, int fps, int drFlags) {
   fps_time = ((int)(1000000 / (fps)));
   // need to implement get screen width and height
@@ -313,28 +329,55 @@ static int drm_setup(int width, int height, int fps, int drFlags) {
 
   connModePtr = &drmInfoPtr->crtc_mode;
   if (drFlags & MODESET) {
-    int findmode = 0;
+    double oldRefresh = drm_mode_refresh(connModePtr);
+    int best = -1;
+    double bestJudder = 0, bestRefresh = 0;
+    int bestDistance = 0;
+    bool bestCovers = false;
     for (int i = 0; i < connPtr->count_modes; i++) {
-      if (width == connPtr->modes[i].hdisplay && height == connPtr->modes[i].vdisplay && fps == connPtr->modes[i].vrefresh && (connPtr->modes[i].flags & DRM_MODE_FLAG_INTERLACE) == 0) {
-        findmode = 1;
-        drmInfoPtr->width = connPtr->modes[i].hdisplay;
-        drmInfoPtr->height = connPtr->modes[i].vdisplay;
-        connModePtr = &connPtr->modes[i];
-        memcpy(&drmInfoPtr->crtc_mode,&connPtr->modes[i],sizeof(connPtr->modes[i]));
-        break;
+      drmModeModeInfoPtr mode = &connPtr->modes[i];
+      if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+        continue;
+      double refresh = drm_mode_refresh(mode);
+      double judder = drm_mode_judder(refresh, fps);
+      int distance = abs(width - mode->hdisplay) + abs(height - mode->vdisplay);
+      // a mode smaller than the stream loses detail, so only fall back to one when nothing covers it
+      bool covers = mode->hdisplay >= width && mode->vdisplay >= height;
+      // refresh rates a tenth of a judder per second apart count as equal, e.g. 59.94 and 60
+      if (best < 0 || (covers && !bestCovers) ||
+          (covers == bestCovers && (judder < bestJudder - 0.1 ||
+           (judder < bestJudder + 0.1 && (distance < bestDistance || (distance == bestDistance && refresh > bestRefresh)))))) {
+        best = i;
+        bestJudder = judder;
+        bestRefresh = refresh;
+        bestDistance = distance;
+        bestCovers = covers;
       }
     }
-    if (findmode == 0) {
+    if (best >= 0) {
+      drmInfoPtr->width = connPtr->modes[best].hdisplay;
+      drmInfoPtr->height = connPtr->modes[best].vdisplay;
+      connModePtr = &connPtr->modes[best];
+      memcpy(&drmInfoPtr->crtc_mode,&connPtr->modes[best],sizeof(connPtr->modes[best]));
+      printf("DRM: modeset to %dx%d@%.2f Hz for %dx%d@%d, judder %.2f/s (was %.2f/s at %.2f Hz).\n",
+             drmInfoPtr->width, drmInfoPtr->height, bestRefresh, width, height, fps,
+             bestJudder, drm_mode_judder(oldRefresh, fps), oldRefresh);
+    }
+    else {
       fprintf(stderr, "Could not find supported resolution with configured: width-%d height-%d.\n", width, height);
-      fprintf(stderr, "supported resolution is:");
-      for (int i = 0; i < connPtr->count_modes; i++) {
-        fprintf(stderr, " %dx%d@%d ", connPtr->modes[i].hdisplay, connPtr->modes[i].vdisplay, connPtr->modes[i].vrefresh);
-      }
-      fprintf(stderr, "\n");
     }
   }
+  drm_flip_set_mode(connModePtr);
+
+  if (drFlags & VRR) {
+    if (drm_enable_vrr(drmInfoPtr->vrr_min_hz) == 0)
+      printf("DRM: vrr enabled, panel range %u-%u Hz.\n", drmInfoPtr->vrr_min_hz, drmInfoPtr->vrr_max_hz);
+    else
+      fprintf(stderr, "DRM: connector is not vrr capable, keep fixed refresh.\n");
+  }
 
   uint32_t rotate = drFlags & DISPLAY_ROTATE_MASK;
+  drm_config.rotate = rotate;
   if (rotate) drm_opt_commit(DRM_ADD_COMMIT, NULL, drmInfoPtr->plane_id, drmInfoPtr->plane_rotation_prop_id, (rotate >> 2));
 
   if (drFlags & DRM_RENDER) {
@@ -343,7 +386,7 @@ static int drm_setup(int width, int height, int fps, int drFlags) {
     if ((drFlags & EGL_RENDER) == 0) return -1;
     uint32_t format = wantHdr ? DEFAULT_FORMAT_10BIT : DEFAULT_FORMAT;
     display_callback_drm.hdr_support = false;
-    int planes = generate_gbm_buffer(drmInfoPtr->fd, drm_buf, MAX_FB_NUM, gbm_display, drmInfoPtr->width, drmInfoPtr->height, wantHdr ? AV_PIX_FMT_X2RGB10LE : AV_PIX_FMT_BGR0);
+    int planes = generate_gbm_buffer(drmInfoPtr->fd, drm_buf, videoBufferNum, gbm_display, drmInfoPtr->width, drmInfoPtr->height, wantHdr ? AV_PIX_FMT_X2RGB10LE : AV_PIX_FMT_BGR0);
     if (planes < 0)
       return -1;
     gbm_window = gbm_get_window(drmInfoPtr->fd, gbm_display, drmInfoPtr->width, drmInfoPtr->height, format);
@@ -407,7 +450,17 @@ static void drm_clear_image_cache (int drm_fd, struct _drm_buf *drm_buf, int buf
   }
 }
 
+static int drm_set_release (void (*release) (void *data), void (*presented) (void *data, uint64_t present_us)) {
+  if (release == NULL) {
+    drm_flip_stop();
+    return 0;
+  }
+
+  return drm_flip_start(drmInfoPtr->fd, release, presented);
+}
+
 static void drm_cleanup (void *data) {
+  drm_flip_stop();
   if (hdr_blob > 0)
     drmModeDestroyPropertyBlob(drmInfoPtr->fd, hdr_blob);
   hdr_blob = 0;
@@ -453,7 +506,7 @@ static int set_hdr_metadata_blob (struct Drm_Info *drmInfoPtr, bool hdractive, u
 
   if (!hdrp) {
     drm_opt_commit(DRM_ADD_COMMIT, NULL, drmInfoPtr->connector_id, drmInfoPtr->conn_hdr_metadata_prop_id, 0);
-    drm_opt_commit(DRM_ADD_COMMIT, NULL, drmInfoPtr->plane_id, drmInfoPtr->plane_eotf_prop_id, 0);
+    drm_choose_plane_eotf(0);
     return 0;
   }
 
@@ -482,7 +535,7 @@ static int set_hdr_metadata_blob (struct Drm_Info *drmInfoPtr, bool hdractive, u
   }
 
   drm_opt_commit(DRM_ADD_COMMIT, NULL, drmInfoPtr->connector_id, drmInfoPtr->conn_hdr_metadata_prop_id, (uint64_t)(*hdr_blob));
-  drm_opt_commit(DRM_ADD_COMMIT, NULL, drmInfoPtr->plane_id, drmInfoPtr->plane_eotf_prop_id, 2);
+  drm_choose_plane_eotf(2);
 
   return 0;
 }
@@ -501,8 +554,15 @@ static int drm_display_loop(void *data, int width, int height, int index) {
   if (fb_id <= 0 || data == NULL)
     return -1;
 
-  if (tty_stat.out || last_fbid == fb_id) {
-    usleep(fps_time);
+  if (drm_flip_is_async()) {
+    // every image comes only once, the ones not flipped go straight back
+    if (tty_stat.out) {
+      drm_flip_release(data);
+      return 0;
+    }
+  }
+  else if (tty_stat.out || last_fbid == fb_id) {
+    drm_flip_wait_vblank(fps_time);
     return 0;
   }
   last_fbid = fb_id;
@@ -529,11 +589,11 @@ static int drm_display_loop(void *data, int width, int height, int index) {
     set_hdr_metadata_blob (drmInfoPtr, ffmpeg_has_hdr_metadata(frame), &hdr_blob);
   }
 
-  return drm_flip_buffer(drmInfoPtr->fd, drmInfoPtr->crtc_id, fb_id, hdr_blob, drm_buf[index].width[0], drm_buf[index].height[0]);
+  return drm_flip_buffer(drmInfoPtr->fd, drmInfoPtr->crtc_id, fb_id, hdr_blob, drm_buf[index].width[0], drm_buf[index].height[0], data);
 }
 
 static void drm_export_buffer(struct Source_Buffer_Info buffers[MAX_FB_NUM], int *buffer_num, int *plane_num) {
-  *buffer_num = MAX_FB_NUM;
+  *buffer_num = videoBufferNum;
   *plane_num = 1;
   for (int i = 0; i < *buffer_num; i++) {
     memcpy(&buffers[i], &drm_buf[i], sizeof(buffers[i]));
@@ -589,6 +649,7 @@ struct DISPLAY_CALLBACK display_callback_drm = {
   .display_modify_window = drm_switch_vt,
   .display_vsync_loop = drm_display_loop,
   .display_exported_buffer_info = drm_export_buffer,
+  .display_set_release = drm_set_release,
   .renders = DRM_RENDER | EGL_RENDER,
 };
 
@@ -631,7 +692,7 @@ static int get_config_from_frame(struct Render_Config *config) {
 
     int flags = 0;
     drm_clear_image_cache(drmInfoPtr->fd, drm_buf, MAX_FB_NUM);
-    format = drm_generate_drm_buf(drmInfoPtr->fd, drm_config.dst_fmt, config->width, config->height, flags, drm_buf, MAX_FB_NUM);
+    format = drm_generate_drm_buf(drmInfoPtr->fd, drm_config.dst_fmt, config->width, config->height, flags, drm_buf, videoBufferNum);
   }
   else {
     switch (config->pix_fmt) {
@@ -648,7 +709,17 @@ static int get_config_from_frame(struct Render_Config *config) {
     format = translate_format_to_drm(drm_config.dst_fmt, &drm_config.bpp, &drm_config.buffer_multi, &drm_config.plane_num);
   }
 
-  if (format == 0 || drm_get_plane_info(drmInfoPtr, format) < 0) {
+  // the first flip validates the video plane with a test commit,
+  // overlays rarely rotate so rotation keeps the plane chosen at init,
+  // hardware frames without an exported layout are only checked by that test
+  uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+  if (drm_render.decoder_type == SOFTWARE)
+    modifier = DRM_FORMAT_MOD_LINEAR;
+  else if (config->has_modifier)
+    modifier = config->modifier;
+  bool video_plane = format != 0 && drmInfoPtr->have_atomic && drm_config.rotate == 0 &&
+                     drm_choose_video_plane(drmInfoPtr, format, modifier) == 0;
+  if (!video_plane && (format == 0 || drm_get_plane_info(drmInfoPtr, format) < 0)) {
     fprintf(stderr, "DRM: could not find supported format with ffmpeg pix format(%d).\n", drm_config.dst_fmt);
     fprintf(stderr, "Please try add '-filters scale:fmt' option to cmd.\n");
     return -1;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext_drm.h>
@@ -10,8 +11,13 @@
 #include <fcntl.h>
 #include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include "drm_base.h"
+#include "drm_vrr.h"
 
 static struct Drm_Info current_drm_info = {0},old_drm_info = {0};
 static const char *drm_device = "/dev/dri/card0";
@@ -70,7 +76,7 @@ static int num_compare (const void *a, const void *b) {
   return -(*(int *)a - *(int *)b);
 }
 
-int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint32_t prop_id, uint64_t value) {
+static int drm_opt_commit_locked (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint32_t prop_id, uint64_t value) {
   #define MAX_PROP_SLOT_NUM 99
   // opt 0 is add, 1 is get, 2 is clear;
   struct {
@@ -138,9 +144,16 @@ int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint3
   case DRM_RESTORE_COMMIT:
     if (restore_list.count == 0) return -1;
     for (int i = 0; i < restore_list.count; i++) {
-      drm_opt_commit (DRM_ADD_COMMIT, NULL, restore_list.list[i].device_id, restore_list.list[i].prop_id, restore_list.list[i].value);
+      drm_opt_commit_locked (DRM_ADD_COMMIT, NULL, restore_list.list[i].device_id, restore_list.list[i].prop_id, restore_list.list[i].value);
     }
     return restore_list.count;
+  case DRM_TEST_COMMIT:
+    // same as apply, but the list stays for the real commit
+    if (commit_list.count == 0 || data == NULL) return -1;
+    for (int i = 0; i < commit_list.count; i++) {
+      drmModeAtomicAddProperty((drmModeAtomicReq *) data, commit_list.list[i].device_id, commit_list.list[i].prop_id, commit_list.list[i].value);
+    }
+    return commit_list.count;
   case DRM_CLEAR_LIST:
     if (commit_list.list == NULL) return 0;
     if (restore_list.list != NULL) free(restore_list.list);
@@ -157,6 +170,17 @@ int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint3
   return -1;
 }
 
+// the flip thread applies the list while the display thread is still adding to it
+int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint32_t prop_id, uint64_t value) {
+  static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&commit_mutex);
+  int ret = drm_opt_commit_locked(opt, data, device_id, prop_id, value);
+  pthread_mutex_unlock(&commit_mutex);
+
+  return ret;
+}
+
 static inline void drm_get_prop_enum (int fd, const char** names, uint32_t count, uint32_t prop_id, uint64_t *values) {
   drmModePropertyPtr prop = drmModeGetProperty(fd, prop_id);
   if (prop) {
@@ -391,6 +415,17 @@ static int drm_choose_crtc (int fd) {
   return 0;
 }
 
+static void drm_get_vrr_range (int fd, uint32_t blob_id, uint32_t *min_hz, uint32_t *max_hz) {
+  drmModePropertyBlobPtr blob = blob_id != 0 ? drmModeGetPropertyBlob(fd, blob_id) : NULL;
+  if (blob == NULL)
+    return;
+
+  drm_parse_vrr_range(blob->data, blob->length, min_hz, max_hz);
+  drmModeFreePropertyBlob(blob);
+
+  return;
+}
+
 static int drm_get_plane (struct Drm_Info *drm_info, uint32_t format) {
   int format_site;
 
@@ -480,19 +515,20 @@ static int drm_get_plane (struct Drm_Info *drm_info, uint32_t format) {
   }
 
   if (drm_props.snap.props_num == 0) {
-#define CONUM 6
+#define CONUM 8
 #define CRNUM 4
 #define PNUM 14
 #define CNUM (CONUM + CRNUM)
 #define NUMS (CNUM + PNUM)
 
-    const char *names[] = { "CRTC_ID", "HDR_OUTPUT_METADATA", "Colorspace", "max bpc", "Broadcast RGB", "allm_enable",
+    const char *names[] = { "CRTC_ID", "HDR_OUTPUT_METADATA", "Colorspace", "max bpc", "Broadcast RGB", "allm_enable", "vrr_capable", "EDID",
                              "MODE_ID", "ACTIVE", "VRR_ENABLED", "GAMMA_LUT",
                              "FB_ID", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "rotation", "CRTC_ID", "COLOR_ENCODING", "COLOR_RANGE", "EOTF"
                           };
     uint32_t *props_list[] = { &drm_info->conn_crtc_prop_id, &drm_info->conn_hdr_metadata_prop_id,
                                &drm_info->conn_colorspace_prop_id, &drm_info->conn_max_bpc_prop_id,
                                &drm_info->conn_broadcast_rgb_prop_id, &drm_info->conn_allm_prop_id, 
+                               &drm_info->conn_vrr_capable_prop_id, &drm_info->conn_edid_prop_id,
                                &drm_info->crtc_prop_mode_id, &drm_info->crtc_prop_active,
                                &drm_info->crtc_vrr_prop_id, &drm_info->crtc_gammalut_prop_id,
                                &drm_info->plane_fb_id_prop_id,
@@ -524,6 +560,11 @@ static int drm_get_plane (struct Drm_Info *drm_info, uint32_t format) {
     drm_get_props(drm_info->fd, drm_info->crtc_id, DRM_MODE_OBJECT_CRTC, crtcnames, &cr_stores, CRNUM);
     drm_get_props(drm_info->fd, drm_info->plane_id, DRM_MODE_OBJECT_PLANE, pnames, &p_stores, PNUM);
 
+    if (drm_info->conn_vrr_capable_prop_id != 0) {
+      drm_info->vrr_capable = *values_list[6] ? 1 : 0;
+      drm_get_vrr_range(drm_info->fd, *values_list[7], &drm_info->vrr_min_hz, &drm_info->vrr_max_hz);
+    }
+
     int add_count = 0;
     drm_props.snap.ids = calloc(NUMS, sizeof(uint32_t));
     drm_props.snap.props = calloc(NUMS, sizeof(uint32_t));
@@ -535,7 +576,8 @@ static int drm_get_plane (struct Drm_Info *drm_info, uint32_t format) {
             break;
           }
           if (*props_list[i] == drm_info->plane_color_encoding_prop_id || *props_list[i] == drm_info->plane_color_range_prop_id ||
-              *props_list[i] == drm_info->plane_eotf_prop_id) {
+              *props_list[i] == drm_info->plane_eotf_prop_id || *props_list[i] == drm_info->conn_vrr_capable_prop_id ||
+              *props_list[i] == drm_info->conn_edid_prop_id) {
             continue;
           }
           drm_props.snap.ids[add_count] = ids[i];
@@ -585,6 +627,188 @@ static int drm_choose_plane (int fd, uint32_t format) {
   return drm_get_plane (&current_drm_info, format);
 }
 
+#define MAX_PLANE_CANDIDATES 8
+
+// video planes to try in order, the first one passing a test commit is kept
+struct {
+  uint32_t ids[MAX_PLANE_CANDIDATES];
+  uint64_t types[MAX_PLANE_CANDIDATES];
+  int count;
+  int current;
+  uint32_t primary_id;
+  bool tested;
+} static plane_candidates = {0};
+
+// the flip thread moves to the next candidate while the display thread sets the colour props,
+// the colour config is kept so a plane picked later gets it as well
+struct {
+  pthread_mutex_t mutex;
+  bool valid;
+  enum DrmColorSpace colorspace;
+  bool full_range;
+  int64_t eotf;
+} static plane_color = { .mutex = PTHREAD_MUTEX_INITIALIZER, .eotf = -1 };
+
+// call with plane_color.mutex held
+static int drm_set_plane_color (struct Drm_Info *drm_info) {
+  uint32_t ids[] = { drm_info->plane_id, drm_info->plane_id };
+  uint32_t props[] = { drm_info->plane_color_encoding_prop_id, drm_info->plane_color_range_prop_id };
+  uint64_t values[] = { drm_info->plane_color_encoding_prop_values[plane_color.colorspace], drm_info->plane_color_range_prop_values[plane_color.full_range ? 1 : 0] };
+
+  if (drm_info->have_atomic) {
+    drm_opt_commit (DRM_ADD_COMMIT, NULL, ids[0], props[0], values[0]);
+    drm_opt_commit (DRM_ADD_COMMIT, NULL, ids[1], props[1], values[1]);
+  } else {
+    if (drm_set_props(drm_info->fd, ids, props, values, 2, 0, DRM_MODE_OBJECT_PLANE, NULL) < 0) {
+      perror("Set plane color space and range failed.");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int64_t drm_get_plane_prop_value (int fd, uint32_t plane_id, const char *name) {
+  int64_t value = -1;
+  drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+  if (!props)
+    return -1;
+
+  for (int i = 0; i < props->count_props && value < 0; i++) {
+    drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+    if (!prop)
+      continue;
+    if (strcmp(prop->name, name) == 0)
+      value = props->prop_values[i];
+    drmModeFreeProperty(prop);
+  }
+  drmModeFreeObjectProperties(props);
+
+  return value;
+}
+
+// without IN_FORMATS a plane only scans out linear buffers
+static bool drm_plane_has_modifier (int fd, uint32_t plane_id, uint32_t format, uint64_t modifier) {
+  if (modifier == DRM_FORMAT_MOD_INVALID)
+    return true;
+
+  int64_t blob_id = drm_get_plane_prop_value(fd, plane_id, "IN_FORMATS");
+  drmModePropertyBlobPtr blob = blob_id > 0 ? drmModeGetPropertyBlob(fd, blob_id) : NULL;
+  if (blob == NULL)
+    return modifier == DRM_FORMAT_MOD_LINEAR;
+
+  bool found = false;
+  struct drm_format_modifier_blob *header = blob->data;
+  uint32_t *formats = (uint32_t *)((char *)header + header->formats_offset);
+  struct drm_format_modifier *modifiers = (struct drm_format_modifier *)((char *)header + header->modifiers_offset);
+  for (uint32_t i = 0; i < header->count_formats && !found; i++) {
+    if (formats[i] != format)
+      continue;
+    for (uint32_t j = 0; j < header->count_modifiers; j++) {
+      if (modifiers[j].modifier == modifier && i >= modifiers[j].offset && i < modifiers[j].offset + 64 &&
+          (modifiers[j].formats & (1ULL << (i - modifiers[j].offset)))) {
+        found = true;
+        break;
+      }
+    }
+  }
+  drmModeFreePropertyBlob(blob);
+
+  return found;
+}
+
+static void drm_use_plane (struct Drm_Info *drm_info, uint32_t plane_id) {
+  const char *names[] = { "FB_ID", "CRTC_ID", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+                          "rotation", "COLOR_ENCODING", "COLOR_RANGE", "EOTF" };
+  uint32_t *props_list[] = { &drm_info->plane_fb_id_prop_id, &drm_info->plane_crtc_prop_id,
+                             &drm_info->plane_crtc_x_prop_id, &drm_info->plane_crtc_y_prop_id,
+                             &drm_info->plane_crtc_w_prop_id, &drm_info->plane_crtc_h_prop_id,
+                             &drm_info->plane_src_x_prop_id, &drm_info->plane_src_y_prop_id,
+                             &drm_info->plane_src_w_prop_id, &drm_info->plane_src_h_prop_id,
+                             &drm_info->plane_rotation_prop_id, &drm_info->plane_color_encoding_prop_id,
+                             &drm_info->plane_color_range_prop_id, &drm_info->plane_eotf_prop_id };
+  int num = sizeof(names) / sizeof(names[0]);
+  uint64_t tmp_value[sizeof(names) / sizeof(names[0])] = {0};
+  uint64_t *values_list[sizeof(names) / sizeof(names[0])];
+  for (int i = 0; i < num; i++) {
+    *props_list[i] = 0;
+    values_list[i] = &tmp_value[i];
+  }
+  struct _props_ptr stores = { .props = props_list, .props_value = values_list, .props_num = 0 };
+
+  pthread_mutex_lock(&plane_color.mutex);
+  drm_info->plane_id = plane_id;
+  drm_get_props(drm_info->fd, plane_id, DRM_MODE_OBJECT_PLANE, names, &stores, num);
+
+  const char *color_space_name[3] = { "ITU-R BT.601 YCbCr", "ITU-R BT.709 YCbCr", "ITU-R BT.2020 YCbCr" };
+  memset(drm_info->plane_color_encoding_prop_values, 0, sizeof(drm_info->plane_color_encoding_prop_values));
+  drm_get_prop_enum (drm_info->fd, color_space_name, 3, drm_info->plane_color_encoding_prop_id, drm_info->plane_color_encoding_prop_values);
+  const char *colorange_name[3] = { "YCbCr limited range", "YCbCr full range", "nonono"};
+  memset(drm_info->plane_color_range_prop_values, 0, sizeof(drm_info->plane_color_range_prop_values));
+  drm_get_prop_enum (drm_info->fd, colorange_name, 3, drm_info->plane_color_range_prop_id, drm_info->plane_color_range_prop_values);
+  if (plane_color.valid)
+    drm_set_plane_color(drm_info);
+  if (plane_color.eotf >= 0)
+    drm_opt_commit(DRM_ADD_COMMIT, NULL, plane_id, drm_info->plane_eotf_prop_id, plane_color.eotf);
+  pthread_mutex_unlock(&plane_color.mutex);
+
+  // an overlay scans out alone, the console would show through the borders,
+  // falling back to the primary overrides this with the plane props of the flip
+  if (plane_candidates.primary_id != 0 && plane_id != plane_candidates.primary_id) {
+    drm_opt_commit(DRM_ADD_COMMIT, NULL, plane_candidates.primary_id, drm_info->plane_fb_id_prop_id, 0);
+    drm_opt_commit(DRM_ADD_COMMIT, NULL, plane_candidates.primary_id, drm_info->plane_crtc_prop_id, 0);
+  }
+
+  plane_candidates.tested = false;
+
+  return;
+}
+
+// overlays first, they scale in the display controller instead of a gpu pass
+int drm_choose_video_plane (struct Drm_Info *drm_info, uint32_t format, uint64_t modifier) {
+  drmModePlaneRes* res = drmModeGetPlaneResources(drm_info->fd);
+  if (!res) {
+    fprintf(stderr, "Could not get res for plane\n");
+    return -1;
+  }
+
+  memset(&plane_candidates, 0, sizeof(plane_candidates));
+  const uint64_t order[] = { DRM_PLANE_TYPE_OVERLAY, DRM_PLANE_TYPE_PRIMARY };
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < res->count_planes && plane_candidates.count < MAX_PLANE_CANDIDATES; i++) {
+      drmModePlane* plane = drmModeGetPlane(drm_info->fd, res->planes[i]);
+      if (!plane)
+        continue;
+      int64_t type = drm_get_plane_prop_value(drm_info->fd, plane->plane_id, "type");
+      bool usable = (plane->possible_crtcs & (1 << drm_info->crtc_index)) && type == order[pass] &&
+                    (plane->crtc_id == 0 || plane->crtc_id == drm_info->crtc_id);
+      if (usable && type == DRM_PLANE_TYPE_PRIMARY && plane_candidates.primary_id == 0)
+        plane_candidates.primary_id = plane->plane_id;
+      bool has_format = false;
+      for (int j = 0; usable && j < plane->count_formats; j++) {
+        if (plane->formats[j] == format) {
+          has_format = true;
+          break;
+        }
+      }
+      if (has_format && drm_plane_has_modifier(drm_info->fd, plane->plane_id, format, modifier)) {
+        plane_candidates.ids[plane_candidates.count] = plane->plane_id;
+        plane_candidates.types[plane_candidates.count] = type;
+        plane_candidates.count++;
+      }
+      drmModeFreePlane(plane);
+    }
+  }
+  drmModeFreePlaneResources(res);
+
+  if (plane_candidates.count == 0)
+    return -1;
+
+  drm_use_plane(drm_info, plane_candidates.ids[0]);
+
+  return 0;
+}
+
 static int drm_get_connector_hdr_props (int fd) {
   if (current_drm_info.conn_hdr_metadata_prop_id == 0 || current_drm_info.plane_color_encoding_prop_id == 0) {
     fprintf(stderr, "Could not get hdr property for connector\n");
@@ -697,6 +921,11 @@ int drm_get_plane_info (struct Drm_Info *drm_info, uint32_t format) {
 }
 
 void drm_close() {
+  memset(&plane_candidates, 0, sizeof(plane_candidates));
+  pthread_mutex_lock(&plane_color.mutex);
+  plane_color.valid = false;
+  plane_color.eotf = -1;
+  pthread_mutex_unlock(&plane_color.mutex);
   drm_opt_commit(DRM_CLEAR_LIST, NULL, 0, 0, 0);
   drm_clear_snap(&drm_props.snap);
   if (current_drm_info.crtc_mode_blob_id != 0)
@@ -714,6 +943,12 @@ void drm_restore_display() {
       if (drm_set_props(current_drm_info.fd, drm_props.snap.ids, drm_props.snap.props, drm_props.snap.props_value, drm_props.snap.props_num, DRM_MODE_ATOMIC_ALLOW_MODESET, 0, NULL) < 0) {
        perror("Restore display failed: ");
       }
+      if (plane_candidates.primary_id != 0 && current_drm_info.plane_id != plane_candidates.primary_id) {
+        uint32_t ids[] = { current_drm_info.plane_id, current_drm_info.plane_id };
+        uint32_t props[] = { current_drm_info.plane_fb_id_prop_id, current_drm_info.plane_crtc_prop_id };
+        uint64_t values[] = { 0, 0 };
+        drm_set_props(current_drm_info.fd, ids, props, values, 2, 0, DRM_MODE_OBJECT_PLANE, NULL);
+      }
     }
     else {
       drmModeSetCrtc(current_drm_info.fd, current_drm_info.crtc_id, old_drm_info.crtc_fb_id, 0, 0, &current_drm_info.connector_id, 1, &old_drm_info.crtc_mode);
@@ -861,10 +1096,130 @@ void printf_props () {
   continue;
 }
 */
+struct _flip_slot {
+  uint32_t fb_id;
+  uint32_t width;
+  uint32_t height;
+  void *data;
+};
+
+// commit this long before the predicted vblank, grows when vblanks are missed
+#define FLIP_COMMIT_MARGIN_US 1500
+#define FLIP_MARGIN_STEP_US 500
+#define FLIP_MARGIN_DECAY_FLIPS 300
+
+// shown is on screen, inflight waits for its flip event, queued waits for the commit deadline
+struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  // read without the mutex by the flip thread and the render path
+  atomic_bool running;
+  bool pending;
+  int fd;
+  int wakefd[2];
+  uint32_t crtc_id;
+  uint64_t hdr_blob;
+  struct _flip_slot shown;
+  struct _flip_slot inflight;
+  struct _flip_slot queued;
+  void (*release) (void *data);
+  void (*presented) (void *data, uint64_t vblank_us);
+  int64_t vblank_us;
+  unsigned int vblank_seq;
+  unsigned int target_seq;
+  int64_t period_us;
+  int64_t margin_us;
+  uint32_t ontime;
+  bool vrr;
+  int64_t max_frame_us;
+  uint64_t repeated;
+  uint64_t flips;
+  uint64_t replaced;
+  uint64_t late;
+  uint64_t missed;
+  uint64_t failed;
+} static flip_state = { .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .wakefd = { -1, -1 } };
+
+// same clock as the flip event timestamps
+static inline int64_t drm_time_us () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// first vblank after now, 0 until a flip event gave the phase
+static int64_t drm_next_vblank (int64_t now) {
+  if (flip_state.vblank_us == 0 || flip_state.period_us <= 0)
+    return 0;
+  return flip_state.vblank_us + ((now - flip_state.vblank_us) / flip_state.period_us + 1) * flip_state.period_us;
+}
+
+// nominal frame time of the mode, the flip events refine it
+static int64_t drm_mode_period_us (const drmModeModeInfo *mode) {
+  return mode->clock > 0 ? (int64_t)mode->htotal * mode->vtotal * 1000 / mode->clock : 0;
+}
+
+// call with flip_state.mutex held
+static int drm_flip_submit (struct _flip_slot *slot) {
+  int64_t vblank = drm_next_vblank(drm_time_us());
+
+  int res = drmpageflip(flip_state.fd, flip_state.crtc_id, slot->fb_id, flip_state.hdr_blob, slot->width, slot->height, NULL);
+  if (res < 0) {
+    fprintf(stderr, "drmModePageFlip() failed: %d\n", res);
+    flip_state.failed++;
+    return -1;
+  }
+
+  flip_state.target_seq = vblank > 0 && !flip_state.vrr ? flip_state.vblank_seq + (vblank - flip_state.vblank_us) / flip_state.period_us : 0;
+  flip_state.inflight = *slot;
+  flip_state.pending = true;
+  return 0;
+}
+
 static void page_flip_handler(int fd, unsigned int frame, unsigned int sec,
                               unsigned int usec, void *data) {
-  int *done = data;
-  *done = 1;
+  void *released = NULL, *shown = NULL;
+  int64_t vblank = (int64_t)sec * 1000000 + usec;
+
+  pthread_mutex_lock(&flip_state.mutex);
+  if (flip_state.vblank_seq != 0 && frame > flip_state.vblank_seq) {
+    // follow the measured refresh, the mode clock is only nominal
+    int64_t interval = (vblank - flip_state.vblank_us) / (frame - flip_state.vblank_seq);
+    if (interval > flip_state.period_us / 2 && interval < flip_state.period_us * 3 / 2)
+      flip_state.period_us += (interval - flip_state.period_us) / 16;
+  }
+  flip_state.vblank_us = vblank;
+  flip_state.vblank_seq = frame;
+
+  if (flip_state.pending) {
+    if (flip_state.target_seq != 0 && frame > flip_state.target_seq) {
+      flip_state.missed += frame - flip_state.target_seq;
+      flip_state.ontime = 0;
+      if (flip_state.margin_us + FLIP_MARGIN_STEP_US < flip_state.period_us / 2)
+        flip_state.margin_us += FLIP_MARGIN_STEP_US;
+    }
+    else if (++flip_state.ontime >= FLIP_MARGIN_DECAY_FLIPS) {
+      flip_state.ontime = 0;
+      if (flip_state.margin_us > FLIP_COMMIT_MARGIN_US)
+        flip_state.margin_us -= FLIP_MARGIN_STEP_US / 5;
+    }
+
+    // the old buffer is off the screen only now
+    if (flip_state.shown.data != flip_state.inflight.data)
+      released = flip_state.shown.data;
+    flip_state.shown = flip_state.inflight;
+    shown = flip_state.shown.data;
+    memset(&flip_state.inflight, 0, sizeof(flip_state.inflight));
+    flip_state.pending = false;
+    flip_state.flips++;
+  }
+  pthread_mutex_unlock(&flip_state.mutex);
+
+  // the vblank timestamp is on the monotonic clock, the moment the frame reached the screen
+  if (shown != NULL && flip_state.presented != NULL)
+    flip_state.presented(shown, vblank);
+  if (released != NULL && flip_state.release != NULL)
+    flip_state.release(released);
 }
 
 static drmEventContext evctx = {
@@ -876,16 +1231,7 @@ static int drmpageflip_legacy(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uin
   return drmModePageFlip(fd, crtc_id, fb_id, DRM_MODE_PAGE_FLIP_EVENT, data);
 }
 
-static int drmpageflip_atomic(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint64_t hdr_data, uint32_t width, uint32_t height, void *data) {
-  int ret = -1;
-  uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
-  // | DRM_MODE_ATOMIC_NONBLOCK;
-  drmModeAtomicReq *req = drmModeAtomicAlloc();
-
-  if (!req)
-    return -1;
-
-  if (drm_opt_commit (DRM_APPLY_COMMIT, req, 0, 0, 0) > 0) flags = (flags & ~DRM_MODE_ATOMIC_NONBLOCK) | DRM_MODE_ATOMIC_ALLOW_MODESET;
+static void drm_add_plane_props (drmModeAtomicReq *req, uint32_t crtc_id, uint32_t fb_id, uint32_t width, uint32_t height) {
   if (fb_id > 0)
     drmModeAtomicAddProperty(req, current_drm_info.plane_id, current_drm_info.plane_fb_id_prop_id, fb_id);
   drmModeAtomicAddProperty(req, current_drm_info.plane_id, current_drm_info.plane_crtc_prop_id, crtc_id);
@@ -897,6 +1243,49 @@ static int drmpageflip_atomic(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uin
   drmModeAtomicAddProperty(req, current_drm_info.plane_id, current_drm_info.plane_crtc_y_prop_id, dst_site.y);
   drmModeAtomicAddProperty(req, current_drm_info.plane_id, current_drm_info.plane_crtc_w_prop_id, dst_site.width);
   drmModeAtomicAddProperty(req, current_drm_info.plane_id, current_drm_info.plane_crtc_h_prop_id, dst_site.height);
+}
+
+// the first real buffer decides whether the chosen plane can scan it out and scale it
+static void drm_test_video_plane (uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint32_t width, uint32_t height) {
+  while (!plane_candidates.tested && plane_candidates.count > 0) {
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req)
+      return;
+    drm_opt_commit (DRM_TEST_COMMIT, req, 0, 0, 0);
+    drm_add_plane_props(req, crtc_id, fb_id, width, height);
+    int ret = drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+    drmModeAtomicFree(req);
+
+    if (ret == 0) {
+      printf("DRM: scan out %ux%u on %s plane %u.\n", width, height,
+             plane_candidates.types[plane_candidates.current] == DRM_PLANE_TYPE_OVERLAY ? "overlay" : "primary", current_drm_info.plane_id);
+      plane_candidates.tested = true;
+    }
+    else if (plane_candidates.current + 1 < plane_candidates.count) {
+      fprintf(stderr, "DRM: plane %u failed the test commit, try the next one.\n", current_drm_info.plane_id);
+      plane_candidates.current++;
+      drm_use_plane(&current_drm_info, plane_candidates.ids[plane_candidates.current]);
+    }
+    else {
+      fprintf(stderr, "DRM: no plane passed the test commit, keep plane %u.\n", current_drm_info.plane_id);
+      plane_candidates.tested = true;
+    }
+  }
+}
+
+static int drmpageflip_atomic(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint64_t hdr_data, uint32_t width, uint32_t height, void *data) {
+  int ret = -1;
+  uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+  if (fb_id > 0)
+    drm_test_video_plane(fd, crtc_id, fb_id, width, height);
+
+  drmModeAtomicReq *req = drmModeAtomicAlloc();
+  if (!req)
+    return -1;
+
+  if (drm_opt_commit (DRM_APPLY_COMMIT, req, 0, 0, 0) > 0) flags = (flags & ~DRM_MODE_ATOMIC_NONBLOCK) | DRM_MODE_ATOMIC_ALLOW_MODESET;
+  drm_add_plane_props(req, crtc_id, fb_id, width, height);
 
   ret = drmModeAtomicCommit(fd, req, flags, data);
   drmModeAtomicFree(req);
@@ -906,23 +1295,232 @@ static int drmpageflip_atomic(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uin
   return ret;
 }
 
-int drm_flip_buffer(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint64_t hdr_blob, uint32_t width, uint32_t height) {
-  int done = 0;
-  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+// commits the newest queued frame at the deadline of the next vblank
+static void* drm_flip_thread (void *data) {
+  pthread_setname_np(pthread_self(), "m_flip_t");
+  struct pollfd pfd[2] = { { .fd = flip_state.fd, .events = POLLIN }, { .fd = flip_state.wakefd[0], .events = POLLIN } };
+
+  while (atomic_load(&flip_state.running)) {
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100000000 };
+    void *released = NULL;
+
+    pthread_mutex_lock(&flip_state.mutex);
+    if (flip_state.vrr && !flip_state.pending) {
+      int64_t now = drm_time_us();
+      struct _flip_slot next = flip_state.queued;
+      memset(&flip_state.queued, 0, sizeof(flip_state.queued));
+      if (next.fb_id == 0 && flip_state.shown.fb_id != 0 && flip_state.max_frame_us > 0 && flip_state.vblank_us > 0) {
+        // show the frame again before the panel drops below its minimum refresh
+        int64_t deadline = flip_state.vblank_us + flip_state.max_frame_us - flip_state.margin_us;
+        if (now >= deadline) {
+          next = flip_state.shown;
+          flip_state.repeated++;
+        }
+        else if (deadline - now < 100000) {
+          timeout.tv_nsec = (deadline - now) * 1000;
+        }
+      }
+      if (next.fb_id != 0 && drm_flip_submit(&next) < 0 && next.data != flip_state.shown.data)
+        released = next.data;
+    }
+    else if (flip_state.queued.fb_id != 0 && !flip_state.pending) {
+      int64_t now = drm_time_us();
+      int64_t vblank = drm_next_vblank(now);
+      if (vblank == 0 || now >= vblank - flip_state.margin_us) {
+        struct _flip_slot next = flip_state.queued;
+        memset(&flip_state.queued, 0, sizeof(flip_state.queued));
+        if (drm_flip_submit(&next) < 0)
+          released = next.data;
+      }
+      else if (vblank - flip_state.margin_us - now < 100000) {
+        timeout.tv_nsec = (vblank - flip_state.margin_us - now) * 1000;
+      }
+    }
+    pthread_mutex_unlock(&flip_state.mutex);
 
-  int res = drmpageflip(fd, crtc_id, fb_id, hdr_blob, width, height, &done);
-  if (res < 0) {
-    fprintf(stderr, "drmModePageFlip() failed: %d", res);
+    if (released != NULL && flip_state.release != NULL)
+      flip_state.release(released);
+
+    if (ppoll(pfd, 2, &timeout, NULL) > 0) {
+      if (pfd[1].revents & POLLIN) {
+        char buf[16];
+        while (read(pfd[1].fd, buf, sizeof(buf)) > 0);
+      }
+      if (pfd[0].revents & POLLIN)
+        drmHandleEvent(pfd[0].fd, &evctx);
+    }
+  }
+
+  return NULL;
+}
+
+int drm_flip_start (int fd, void (*release) (void *data), void (*presented) (void *data, uint64_t vblank_us)) {
+  if (atomic_load(&flip_state.running))
+    return 0;
+
+  if (pipe(flip_state.wakefd) == -1) {
+    fprintf(stderr, "Could not create drm flip pipe, flips will block.\n");
+    return -1;
+  }
+  fcntl(flip_state.wakefd[0], F_SETFL, O_NONBLOCK);
+
+  flip_state.period_us = drm_mode_period_us(&current_drm_info.crtc_mode);
+  flip_state.margin_us = FLIP_COMMIT_MARGIN_US;
+  flip_state.vblank_us = 0;
+  flip_state.vblank_seq = 0;
+  flip_state.fd = fd;
+  flip_state.release = release;
+  flip_state.presented = presented;
+  atomic_store(&flip_state.running, true);
+  if (pthread_create(&flip_state.thread, NULL, drm_flip_thread, NULL) != 0) {
+    fprintf(stderr, "Could not create drm flip thread, flips will block.\n");
+    atomic_store(&flip_state.running, false);
+    flip_state.release = NULL;
+    flip_state.presented = NULL;
+    close(flip_state.wakefd[0]);
+    close(flip_state.wakefd[1]);
+    flip_state.wakefd[0] = flip_state.wakefd[1] = -1;
     return -1;
   }
 
-  while (!done && (poll(&pfd, 1, 100)) > 0) {
-    drmHandleEvent(fd, &evctx);
+  return 0;
+}
+
+void drm_flip_stop () {
+  if (!atomic_load(&flip_state.running)) {
+    flip_state.vrr = false;
+    return;
   }
 
+  atomic_store(&flip_state.running, false);
+  write(flip_state.wakefd[1], "q", 1);
+  pthread_join(flip_state.thread, NULL);
+  flip_state.release = NULL;
+  flip_state.presented = NULL;
+  close(flip_state.wakefd[0]);
+  close(flip_state.wakefd[1]);
+  flip_state.wakefd[0] = flip_state.wakefd[1] = -1;
+
+  // the images still referenced here are freed together with the buffers
+  pthread_mutex_lock(&flip_state.mutex);
+  memset(&flip_state.shown, 0, sizeof(flip_state.shown));
+  memset(&flip_state.inflight, 0, sizeof(flip_state.inflight));
+  memset(&flip_state.queued, 0, sizeof(flip_state.queued));
+  printf("DRM flips: %" PRIu64 ", stale frames dropped: %" PRIu64 ", late frames: %" PRIu64 ", missed vblanks: %" PRIu64 ", failed: %" PRIu64 "\n",
+         flip_state.flips, flip_state.replaced, flip_state.late, flip_state.missed, flip_state.failed);
+  if (flip_state.vrr)
+    printf("DRM vrr repeated frames: %" PRIu64 "\n", flip_state.repeated);
+  else if (flip_state.period_us > 0)
+    printf("DRM refresh: %.2f Hz, commit margin: %" PRId64 " us\n", 1000000.0 / flip_state.period_us, flip_state.margin_us);
+  flip_state.flips = flip_state.replaced = flip_state.late = flip_state.missed = flip_state.failed = flip_state.repeated = 0;
+  flip_state.vrr = false;
+  // back to the nominal timing for the blocking path, the phase comes with its next flip event
+  flip_state.period_us = drm_mode_period_us(&current_drm_info.crtc_mode);
+  flip_state.margin_us = FLIP_COMMIT_MARGIN_US;
+  flip_state.vblank_us = 0;
+  flip_state.vblank_seq = 0;
+  pthread_mutex_unlock(&flip_state.mutex);
+}
+
+// present immediately, min_hz bounds the time a frame may stay on screen
+int drm_enable_vrr (uint32_t min_hz) {
+  if (!current_drm_info.have_atomic || !current_drm_info.vrr_capable || current_drm_info.crtc_vrr_prop_id == 0)
+    return -1;
+
+  if (drm_queue_vrr(current_drm_info.crtc_id, current_drm_info.crtc_vrr_prop_id, true) < 0)
+    return -1;
+
+  pthread_mutex_lock(&flip_state.mutex);
+  flip_state.vrr = true;
+  flip_state.max_frame_us = min_hz > 0 ? 1000000 / min_hz : 0;
+  pthread_mutex_unlock(&flip_state.mutex);
+
   return 0;
 }
 
+bool drm_flip_is_async () {
+  return atomic_load(&flip_state.running);
+}
+
+// for images the display will not flip, e.g. while the vt is switched away
+void drm_flip_release (void *data) {
+  if (atomic_load(&flip_state.running) && flip_state.release != NULL)
+    flip_state.release(data);
+}
+
+// the mode the display runs at, paces drm_flip_wait_vblank before the flip thread started
+void drm_flip_set_mode (const drmModeModeInfo *mode) {
+  pthread_mutex_lock(&flip_state.mutex);
+  flip_state.period_us = drm_mode_period_us(mode);
+  flip_state.vblank_us = 0;
+  flip_state.vblank_seq = 0;
+  pthread_mutex_unlock(&flip_state.mutex);
+}
+
+// sleeps until the predicted vblank, or for fallback_us before the first flip event
+void drm_flip_wait_vblank (uint64_t fallback_us) {
+  pthread_mutex_lock(&flip_state.mutex);
+  int64_t now = drm_time_us();
+  int64_t vblank = drm_next_vblank(now);
+  pthread_mutex_unlock(&flip_state.mutex);
+
+  usleep(vblank > 0 ? vblank - now : fallback_us);
+}
+
+int drm_flip_buffer(uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint64_t hdr_blob, uint32_t width, uint32_t height, void *data) {
+  struct _flip_slot slot = { .fb_id = fb_id, .width = width, .height = height, .data = data };
+  void *replaced = NULL;
+  bool wake = false;
+  int res = 0;
+
+  pthread_mutex_lock(&flip_state.mutex);
+  flip_state.fd = fd;
+  flip_state.crtc_id = crtc_id;
+  flip_state.hdr_blob = hdr_blob;
+  if (atomic_load(&flip_state.running)) {
+    int64_t now = drm_time_us();
+    int64_t vblank = drm_next_vblank(now);
+    if (!flip_state.pending && flip_state.vrr) {
+      // the panel waits for the frame, flip as soon as it is rendered
+      res = drm_flip_submit(&slot);
+    }
+    else if (!flip_state.pending && vblank > 0 && now >= vblank - flip_state.margin_us) {
+      // past the deadline, commit now and hope the vblank is still caught
+      flip_state.late++;
+      res = drm_flip_submit(&slot);
+    }
+    else {
+      // mailbox, a newer frame takes the place of one that has not been committed yet
+      if (flip_state.queued.fb_id != 0) {
+        replaced = flip_state.queued.data;
+        flip_state.replaced++;
+      }
+      flip_state.queued = slot;
+      wake = !flip_state.pending;
+    }
+  }
+  else {
+    res = drm_flip_submit(&slot);
+  }
+  bool wait = !atomic_load(&flip_state.running) && res == 0;
+  pthread_mutex_unlock(&flip_state.mutex);
+
+  if (wake)
+    write(flip_state.wakefd[1], "w", 1);
+  if (replaced != NULL && flip_state.release != NULL)
+    flip_state.release(replaced);
+
+  if (wait) {
+    // without the flip thread wait for the event here
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (flip_state.pending && (poll(&pfd, 1, 100)) > 0) {
+      drmHandleEvent(fd, &evctx);
+    }
+  }
+
+  return res;
+}
+
 int drm_set_display(int fd, uint32_t crtc_id, uint32_t src_width, uint32_t src_height, uint32_t crtc_w, uint32_t crtc_h, uint32_t *connector_id, uint32_t connector_num, drmModeModeInfoPtr connModePtr, uint32_t fb_id) {
   if (current_drm_info.have_atomic) {
     dst_site.width = crtc_w;
@@ -952,21 +1550,23 @@ int drm_set_display(int fd, uint32_t crtc_id, uint32_t src_width, uint32_t src_h
 }
 
 int drm_choose_color_config (enum DrmColorSpace colorspace, bool fullRange) {
-  uint32_t ids[] = { current_drm_info.plane_id, current_drm_info.plane_id };
-  uint32_t props[] = { current_drm_info.plane_color_encoding_prop_id, current_drm_info.plane_color_range_prop_id };
-  uint64_t values[] = { current_drm_info.plane_color_encoding_prop_values[colorspace], current_drm_info.plane_color_range_prop_values[fullRange ? 1 : 0] };
+  pthread_mutex_lock(&plane_color.mutex);
+  plane_color.valid = true;
+  plane_color.colorspace = colorspace;
+  plane_color.full_range = fullRange;
+  int ret = drm_set_plane_color(&current_drm_info);
+  pthread_mutex_unlock(&plane_color.mutex);
 
-  if (current_drm_info.have_atomic) {
-    drm_opt_commit (DRM_ADD_COMMIT, NULL, ids[0], props[0], values[0]);
-    drm_opt_commit (DRM_ADD_COMMIT, NULL, ids[1], props[1], values[1]);
-  } else {
-    if (drm_set_props(current_drm_info.fd, ids, props, values, 2, 0, DRM_MODE_OBJECT_PLANE, NULL) < 0) {
-      perror("Set plane color space and range failed.");
-      return -1;
-    }
-  }
+  return ret;
+}
 
-  return 0;
+int drm_choose_plane_eotf (uint64_t eotf) {
+  pthread_mutex_lock(&plane_color.mutex);
+  plane_color.eotf = eotf;
+  int ret = drm_opt_commit(DRM_ADD_COMMIT, NULL, current_drm_info.plane_id, current_drm_info.plane_eotf_prop_id, eotf);
+  pthread_mutex_unlock(&plane_color.mutex);
+
+  return ret;
 }
 
 int drm_apply_hdr_metadata(int fd, uint32_t conn_id, uint32_t hdr_metadata_prop_id, struct hdr_output_metadata *data) {
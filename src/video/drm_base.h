@@ -19,6 +19,8 @@
 
 #include <xf86drmMode.h>
 
+#include "drm_commit.h"
+
 #define NEEDED_DRM_FORMAT_NUM 20
 #define MAX_CONNECTOR 5
 
@@ -26,7 +28,6 @@ enum DrmBroadcastRgb { AUTORGB = 0, FULLRGB, LIMITEDRGB };
 enum DrmColorspace { DEFAULTCOLOR = 0, D2020RGB, D2020YCC, D601YCC, D709YCC, D65P3 };
 enum DrmColorSpace { DBT601 = 0, DBT709, DBT2020 };
 enum DrmColorRange { LIMITED_RANGE = 0, FULL_RANGE }; 
-enum DrmCommitOpt { DRM_ADD_COMMIT = 0, DRM_APPLY_COMMIT, DRM_RESTORE_COMMIT, DRM_CLEAR_LIST };
 
 struct Drm_Info {
   int fd;
@@ -44,6 +45,11 @@ struct Drm_Info {
   uint32_t conn_broadcast_rgb_prop_id;
   uint64_t conn_broadcast_rgb_prop_values[3];
   uint32_t conn_allm_prop_id;
+  uint32_t conn_vrr_capable_prop_id;
+  uint32_t conn_edid_prop_id;
+  uint32_t vrr_capable;
+  uint32_t vrr_min_hz;
+  uint32_t vrr_max_hz;
   uint32_t encoder_id;
   uint32_t crtc_id;
   uint32_t crtc_fb_id;
@@ -96,10 +102,19 @@ void drm_restore_display();
 
 void convert_display (const uint32_t *src_w, const uint32_t *src_h, uint32_t *dst_w, uint32_t *dst_h, int *dst_x, int *dst_y);
 int get_drm_dbum_aligned (int fd, int pixfmt, int width, int height);
-int drm_flip_buffer (uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint64_t hdr_data, uint32_t width, uint32_t height);
+// data is handed to release once the buffer has left the screen, blocks while the flip thread is stopped
+int drm_flip_buffer (uint32_t fd, uint32_t crtc_id, uint32_t fb_id, uint64_t hdr_data, uint32_t width, uint32_t height, void *data);
+int drm_flip_start (int fd, void (*release) (void *data), void (*presented) (void *data, uint64_t vblank_us));
+void drm_flip_stop ();
+bool drm_flip_is_async ();
+void drm_flip_release (void *data);
+void drm_flip_set_mode (const drmModeModeInfo *mode);
+void drm_flip_wait_vblank (uint64_t fallback_us);
+int drm_enable_vrr (uint32_t min_hz);
 int drm_get_plane_info (struct Drm_Info *drm_info, uint32_t format);
+int drm_choose_video_plane (struct Drm_Info *drm_info, uint32_t format, uint64_t modifier);
 uint32_t translate_format_to_drm(int format, int *bpp, int *heightmulti, int *planenum);
 int drm_set_display(int fd, uint32_t crtc_id, uint32_t src_w, uint32_t src_h, uint32_t crtc_w, uint32_t crtc_h, uint32_t *connector_id, uint32_t connector_num, drmModeModeInfoPtr connModePtr, uint32_t fb_id);
 int drm_choose_color_config (enum DrmColorSpace colorspace, bool fullRange);
+int drm_choose_plane_eotf (uint64_t eotf);
 int drm_apply_hdr_metadata(int fd, uint32_t conn_id, uint32_t hdr_metadata_prop_id, struct hdr_output_metadata *data);
-int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint32_t prop_id, uint64_t value);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+enum DrmCommitOpt { DRM_ADD_COMMIT = 0, DRM_APPLY_COMMIT, DRM_RESTORE_COMMIT, DRM_CLEAR_LIST, DRM_TEST_COMMIT };
+
+// Property list of the next atomic commit, shared by the display and the flip thread
+int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint32_t prop_id, uint64_t value);
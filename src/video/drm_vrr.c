@@ -0,0 +1,36 @@
+#include "drm_vrr.h"
+#include "drm_commit.h"
+
+#define EDID_BLOCK_SIZE 128
+#define EDID_DESC_START 54
+#define EDID_DESC_SIZE 18
+#define EDID_DESC_COUNT 4
+#define EDID_RANGE_LIMITS_TAG 0xFD
+// Byte 4 of the descriptor adds 255 to the vertical rates above 255 Hz
+#define EDID_RANGE_MIN_OFFSET 0x01
+#define EDID_RANGE_MAX_OFFSET 0x02
+
+bool drm_parse_vrr_range (const uint8_t *edid, size_t length, uint32_t *min_hz, uint32_t *max_hz) {
+  if (edid == NULL || length < EDID_BLOCK_SIZE)
+    return false;
+
+  for (int i = 0; i < EDID_DESC_COUNT; i++) {
+    const uint8_t *desc = &edid[EDID_DESC_START + i * EDID_DESC_SIZE];
+    // display descriptors start with a zero pixel clock, detailed timings never do
+    if (desc[0] != 0 || desc[1] != 0 || desc[2] != 0 || desc[3] != EDID_RANGE_LIMITS_TAG)
+      continue;
+
+    *min_hz = desc[5] + ((desc[4] & EDID_RANGE_MIN_OFFSET) ? 255 : 0);
+    *max_hz = desc[6] + ((desc[4] & EDID_RANGE_MAX_OFFSET) ? 255 : 0);
+    return true;
+  }
+
+  return false;
+}
+
+int drm_queue_vrr (uint32_t crtc_id, uint32_t vrr_prop_id, bool enable) {
+  if (crtc_id == 0 || vrr_prop_id == 0)
+    return -1;
+
+  return drm_opt_commit(DRM_ADD_COMMIT, NULL, crtc_id, vrr_prop_id, enable ? 1 : 0);
+}
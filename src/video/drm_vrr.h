@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Range limits descriptor of the base EDID block, false when the panel has none
+bool drm_parse_vrr_range (const uint8_t *edid, size_t length, uint32_t *min_hz, uint32_t *max_hz);
+// Adds VRR_ENABLED of the crtc to the next commit
+int drm_queue_vrr (uint32_t crtc_id, uint32_t vrr_prop_id, bool enable);
@@ -22,11 +22,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES3/gl3.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
 
 #include <Limelight.h>
 
@@ -35,6 +37,8 @@
 #include "egl_glsl.h"
 #include "video_internal.h"
 #include "render.h"
+#include "video.h"
+#include "../avsync.h"
 
 static struct EGL_Base egl_base = {0};
 static struct Import_Buffer_Info out_fb[MAX_FB_NUM] = {0};
@@ -44,9 +48,11 @@ static EGLDisplay display = EGL_NO_DISPLAY;
 static EGLSurface surface = EGL_NO_SURFACE;
 static EGLContext context = EGL_NO_CONTEXT;
 static EGLConfig config;
-static EGLSync eglsync = EGL_NO_SYNC;
+// one fence per display buffer, the display waits on it right before showing the image
+static EGLSync drawSync[MAX_FB_NUM];
 
-static GLuint texture_id[4], texture_uniform[7];
+static GLuint texture_id[4], texture_uniform[8];
+static GLfloat depthScale[2] = { 1.0f, 0.0f };
 
 static const float *colorOffsets;
 static const float *colorspace;
@@ -68,8 +74,15 @@ static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES = NULL;
 typedef void (GL_APIENTRYP PFNGLEGLIMAGETARGETTEXSTORAGEEXTPROC) (GLenum target, EGLImage image, const GLint* attrib_list);
 #endif
 static PFNGLEGLIMAGETARGETTEXSTORAGEEXTPROC glEGLImageTargetTexStorageEXT;
+#ifndef PFNGLBUFFERSTORAGEEXTPROC
+typedef void (GL_APIENTRYP PFNGLBUFFERSTORAGEEXTPROC) (GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+#endif
+static PFNGLBUFFERSTORAGEEXTPROC glBufferStorageEXT = NULL;
+// 100ms, an upload buffer is normally free again long before
+#define UPLOAD_FENCE_TIMEOUT 100000000
 
 // for planeNum 0, 1, 2, 3, 4
+static GLuint *programs[SHADER_PROGRAM_NUM] = { &egl_base.shader_program_yuv, &egl_base.shader_program_packed, &egl_base.shader_program_nv12 };
 static GLuint *shaders[5] = { &egl_base.shader_program_nv12, &egl_base.shader_program_packed, &egl_base.shader_program_nv12, &egl_base.shader_program_yuv, &egl_base.shader_program_nv12 };
 static const EGLint context_attributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 0,  EGL_NONE };
 
@@ -286,6 +299,17 @@ static bool is_use_ext(struct EXTSTATE *extState) {
     glEGLImageTargetTexStorageEXT = (PFNGLEGLIMAGETARGETTEXSTORAGEEXTPROC)eglGetProcAddress("glEGLImageTargetTexStorageEXT");
   }
 
+  // persistently mapped upload buffers for software frames
+  if (is_gl_extension_support("GL_EXT_buffer_storage")) {
+    glBufferStorageEXT = (PFNGLBUFFERSTORAGEEXTPROC)eglGetProcAddress("glBufferStorageEXT");
+    extState->glIsSupportExtBufferStorage = glBufferStorageEXT != NULL;
+  }
+
+  // 16 bit normalized textures for deep software frames
+  if (is_gl_extension_support("GL_EXT_texture_norm16")) {
+    extState->glIsSupportExtNorm16 = true;
+  }
+
   if (is_gl_extension_support("EGL_KHR_surfaceless_context") && is_gl_extension_support("GL_OES_surfaceless_context")) {
     extState->eglIsSupportExtSurfaceless = true;
   }
@@ -318,6 +342,135 @@ static int generate_shader(GLuint *dst_shader, const char* dst_source, int gl_sh
   return 0;
 }
 
+static inline uint64_t shader_cache_hash(uint64_t hash, const char *data) {
+  // fnv-1a
+  for (; data != NULL && *data; data++)
+    hash = (hash ^ (uint8_t) *data) * 0x100000001b3ULL;
+  return hash;
+}
+
+// binaries only fit the driver that built them, so the key covers the driver and the sources
+static uint64_t shader_cache_key() {
+  const char *parts[] = { (const char *) glGetString(GL_RENDERER), (const char *) glGetString(GL_VERSION),
+                          vertex_source, fragment_source_3plane, fragment_source_nv12, fragment_source_packed };
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    hash = shader_cache_hash(hash, parts[i]);
+  return hash;
+}
+
+static bool shader_cache_path(char *path, size_t size) {
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  if (formats <= 0 || videoCacheDir == NULL || videoCacheDir[0] == 0)
+    return false;
+
+  snprintf(path, size, "%s/%s", videoCacheDir, SHADER_CACHE_FILE);
+  return true;
+}
+
+static bool egl_load_programs(const char *path, uint64_t key) {
+  FILE *fd = fopen(path, "rb");
+  if (fd == NULL)
+    return false;
+
+  struct Shader_Cache_Header header;
+  bool loaded = fread(&header, sizeof(header), 1, fd) == 1 && header.magic == SHADER_CACHE_MAGIC && header.key == key;
+  for (int i = 0; loaded && i < SHADER_PROGRAM_NUM; i++) {
+    struct Shader_Cache_Entry entry;
+    void *binary = NULL;
+    loaded = fread(&entry, sizeof(entry), 1, fd) == 1 && entry.length > 0 && entry.length <= SHADER_CACHE_MAX_SIZE &&
+             (binary = malloc(entry.length)) != NULL && fread(binary, entry.length, 1, fd) == 1;
+    if (loaded) {
+      GLint status = GL_FALSE;
+      *programs[i] = glCreateProgram();
+      glProgramBinary(*programs[i], entry.format, binary, entry.length);
+      glGetProgramiv(*programs[i], GL_LINK_STATUS, &status);
+      // drivers reject binaries of another build even when the version string is the same
+      loaded = status == GL_TRUE;
+    }
+    free(binary);
+  }
+  fclose(fd);
+
+  if (!loaded) {
+    for (int i = 0; i < SHADER_PROGRAM_NUM; i++) {
+      if (*programs[i] != 0)
+        glDeleteProgram(*programs[i]);
+      *programs[i] = 0;
+    }
+  }
+  return loaded;
+}
+
+static void egl_save_programs(const char *path, uint64_t key) {
+  FILE *fd = fopen(path, "wb");
+  if (fd == NULL)
+    return;
+
+  struct Shader_Cache_Header header = { .magic = SHADER_CACHE_MAGIC, .key = key };
+  bool saved = fwrite(&header, sizeof(header), 1, fd) == 1;
+  for (int i = 0; saved && i < SHADER_PROGRAM_NUM; i++) {
+    struct Shader_Cache_Entry entry = {0};
+    GLint length = 0;
+    glGetProgramiv(*programs[i], GL_PROGRAM_BINARY_LENGTH, &length);
+    void *binary = length > 0 ? malloc(length) : NULL;
+    if (binary != NULL) {
+      GLsizei written = 0;
+      GLenum format = 0;
+      glGetProgramBinary(*programs[i], length, &written, &format, binary);
+      entry.format = format;
+      entry.length = written;
+    }
+    saved = entry.length > 0 && fwrite(&entry, sizeof(entry), 1, fd) == 1 && fwrite(binary, entry.length, 1, fd) == 1;
+    free(binary);
+  }
+  fclose(fd);
+
+  // a partial file would only be rejected on the next start
+  if (!saved)
+    remove(path);
+}
+
+static int egl_setup_programs() {
+  uint64_t start = avsync_time_us();
+  char path[4096 + sizeof(SHADER_CACHE_FILE) + 1];
+  bool useCache = shader_cache_path(path, sizeof(path));
+  uint64_t key = useCache ? shader_cache_key() : 0;
+
+  if (useCache && egl_load_programs(path, key)) {
+    printf("EGL: loaded cached shaders in %.1f ms\n", (avsync_time_us() - start) / 1000.0);
+    return 0;
+  }
+
+  if (generate_shader(&egl_base.common_vertex_shader, vertex_source, GL_VERTEX_SHADER) < 0 ||
+      generate_shader(&egl_base.yuv_fragment_shader, fragment_source_3plane, GL_FRAGMENT_SHADER) < 0 ||
+      generate_shader(&egl_base.nv12_fragment_shader, fragment_source_nv12, GL_FRAGMENT_SHADER) < 0 ||
+      generate_shader(&egl_base.packed_fragment_shader, fragment_source_packed, GL_FRAGMENT_SHADER) < 0)
+    return -1;
+
+  egl_base.shader_program_yuv = glCreateProgram();
+  egl_base.shader_program_packed = glCreateProgram();
+  egl_base.shader_program_nv12 = glCreateProgram();
+
+  glAttachShader(egl_base.shader_program_yuv, egl_base.common_vertex_shader);
+  glAttachShader(egl_base.shader_program_packed, egl_base.common_vertex_shader);
+  glAttachShader(egl_base.shader_program_nv12, egl_base.common_vertex_shader);
+  glAttachShader(egl_base.shader_program_packed, egl_base.packed_fragment_shader);
+  glAttachShader(egl_base.shader_program_yuv, egl_base.yuv_fragment_shader);
+  glAttachShader(egl_base.shader_program_nv12, egl_base.nv12_fragment_shader);
+  for (int i = 0; i < SHADER_PROGRAM_NUM; i++) {
+    if (useCache)
+      glProgramParameteri(*programs[i], GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(*programs[i]);
+  }
+
+  if (useCache)
+    egl_save_programs(path, key);
+  printf("EGL: compiled shaders in %.1f ms\n", (avsync_time_us() - start) / 1000.0);
+  return 0;
+}
+
 static int egl_create(struct Render_Init_Info *paras) {
   memset(&egl_base, 0, sizeof(egl_base));
 
@@ -462,6 +615,111 @@ static void egl_sync_window_size(int width, int height, bool isfullscreen) {
   return;
 }
 
+static void egl_destroy_upload_buffers() {
+  for (int i = 0; i < UPLOAD_BUFFER_NUM; i++) {
+    struct Upload_Buffer *upload = &egl_base.upload[i];
+    if (upload->fence)
+      glDeleteSync(upload->fence);
+    if (upload->map) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pbo);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    if (upload->pbo)
+      glDeleteBuffers(1, &upload->pbo);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  memset(egl_base.upload, 0, sizeof(egl_base.upload));
+  egl_base.uploadSize = 0;
+}
+
+static inline int egl_soft_plane_height(int plane) {
+  return (plane > 0 && !isYUV444) ? egl_base.height / 2 : egl_base.height;
+}
+
+// one buffer holds all three planes of a frame, the ring lets the gpu copy
+// the previous frames while the next one is written
+static void egl_init_upload_buffers(const int linesize[3]) {
+  size_t offset = 0;
+  for (int i = 0; i < 3; i++) {
+    egl_base.uploadOffset[i] = offset;
+    offset += ((size_t)linesize[i] * egl_soft_plane_height(i) + 63) & ~(size_t)63;
+  }
+
+  egl_base.uploadPersistent = ExtState.glIsSupportExtBufferStorage;
+  for (int i = 0; i < UPLOAD_BUFFER_NUM; i++) {
+    struct Upload_Buffer *upload = &egl_base.upload[i];
+    glGenBuffers(1, &upload->pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pbo);
+    if (egl_base.uploadPersistent) {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT_EXT | GL_MAP_COHERENT_BIT_EXT;
+      glBufferStorageEXT(GL_PIXEL_UNPACK_BUFFER, offset, NULL, flags);
+      upload->map = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, offset, flags);
+      if (upload->map == NULL) {
+        fprintf(stderr, "EGL: could not map upload buffer, uploading from client memory\n");
+        egl_destroy_upload_buffers();
+        return;
+      }
+    }
+    else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, offset, NULL, GL_STREAM_DRAW);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  egl_base.uploadSize = offset;
+  egl_base.uploadNext = 0;
+}
+
+// samples deeper than 8 bit go to R16 textures, or split into RG8 where
+// norm16 is missing, the shader puts them back together with depthScale
+static int egl_alloc_soft_textures(enum AVPixelFormat pix_fmt, bool fullRange, const int linesize[3]) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+  if (desc == NULL || desc->nb_components != 3 || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+      (desc->flags & AV_PIX_FMT_FLAG_BE) || desc->comp[0].depth > 16) {
+    fprintf(stderr, "EGL: could not upload software frames in format %s\n", av_get_pix_fmt_name(pix_fmt));
+    return -1;
+  }
+
+  int depth = desc->comp[0].depth;
+  GLint internal;
+  // limited range codes of deeper formats are the 8 bit ones shifted up
+  float max = fullRange ? (float)((1 << depth) - 1) : (float)(255 << (depth > 8 ? depth - 8 : 0));
+  if (depth <= 8) {
+    egl_base.softBytes = 1;
+    internal = GL_LUMINANCE;
+    egl_base.softFormat = GL_LUMINANCE;
+    egl_base.softType = GL_UNSIGNED_BYTE;
+    depthScale[0] = 1.0f;
+    depthScale[1] = 0.0f;
+  } else if (ExtState.glIsSupportExtNorm16) {
+    egl_base.softBytes = 2;
+    internal = GL_R16_EXT;
+    egl_base.softFormat = GL_RED;
+    egl_base.softType = GL_UNSIGNED_SHORT;
+    depthScale[0] = 65535.0f / max;
+    depthScale[1] = 0.0f;
+  } else {
+    egl_base.softBytes = 2;
+    internal = GL_RG8;
+    egl_base.softFormat = GL_RG;
+    egl_base.softType = GL_UNSIGNED_BYTE;
+    depthScale[0] = 255.0f / max;
+    depthScale[1] = 255.0f * 256.0f / max;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    glBindTexture(GL_TEXTURE_2D, texture_id[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal, (i > 0 && !isYUV444) ? egl_base.width / 2 : egl_base.width, egl_soft_plane_height(i), 0, egl_base.softFormat, egl_base.softType, 0);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  egl_destroy_upload_buffers();
+  egl_init_upload_buffers(linesize);
+  if (depth > 8)
+    printf("EGL: uploading %d bit frames as %s textures\n", depth, internal == GL_RG8 ? "RG8" : "R16");
+
+  return 0;
+}
+
 static int egl_init(struct Render_Init_Info *paras) {
   if (paras->frame_width == 0 || paras->frame_height == 0 ||
       paras->screen_width == 0 || paras->screen_height == 0) {
@@ -519,26 +777,9 @@ static int egl_init(struct Render_Init_Info *paras) {
 
   glEnable(GL_TEXTURE_2D);
   
-  if (generate_shader(&egl_base.common_vertex_shader, vertex_source, GL_VERTEX_SHADER) < 0 ||
-      generate_shader(&egl_base.yuv_fragment_shader, fragment_source_3plane, GL_FRAGMENT_SHADER) < 0 ||
-      generate_shader(&egl_base.nv12_fragment_shader, fragment_source_nv12, GL_FRAGMENT_SHADER) < 0 ||
-      generate_shader(&egl_base.packed_fragment_shader, fragment_source_packed, GL_FRAGMENT_SHADER) < 0)
+  if (egl_setup_programs() < 0)
     return -1;
 
-  egl_base.shader_program_yuv = glCreateProgram();
-  egl_base.shader_program_packed = glCreateProgram();
-  egl_base.shader_program_nv12 = glCreateProgram();
-
-  glAttachShader(egl_base.shader_program_yuv, egl_base.common_vertex_shader);
-  glAttachShader(egl_base.shader_program_packed, egl_base.common_vertex_shader);
-  glAttachShader(egl_base.shader_program_nv12, egl_base.common_vertex_shader);
-  glAttachShader(egl_base.shader_program_packed, egl_base.packed_fragment_shader);
-  glAttachShader(egl_base.shader_program_yuv, egl_base.yuv_fragment_shader);
-  glAttachShader(egl_base.shader_program_nv12, egl_base.nv12_fragment_shader);
-  glLinkProgram(egl_base.shader_program_yuv);
-  glLinkProgram(egl_base.shader_program_packed);
-  glLinkProgram(egl_base.shader_program_nv12);
-
   glGenVertexArrays(1, &egl_base.VAO);
   glBindVertexArray(egl_base.VAO);
 
@@ -572,6 +813,7 @@ static int egl_init(struct Render_Init_Info *paras) {
   texture_uniform[FRAG_PARAM_PLANE1] = glGetUniformLocation(egl_base.shader_program_yuv, "umap");
   texture_uniform[FRAG_PARAM_PLANE2] = glGetUniformLocation(egl_base.shader_program_yuv, "vmap");
   texture_uniform[FRAG_PARAM_CUTWIDTH] = glGetUniformLocation(egl_base.shader_program_yuv, "cutwidth");
+  texture_uniform[FRAG_PARAM_DEPTHSCALE] = glGetUniformLocation(egl_base.shader_program_yuv, "depthscale");
   texture_uniform[FRAG_PARAM_YUVMAT] = glGetUniformLocation(egl_base.shader_program_packed, "yuvmat");
   texture_uniform[FRAG_PARAM_OFFSET] = glGetUniformLocation(egl_base.shader_program_packed, "offset");
   texture_uniform[FRAG_PARAM_YUVORDER] = glGetUniformLocation(egl_base.shader_program_packed, "yuvorder");
@@ -588,9 +830,6 @@ static int egl_init(struct Render_Init_Info *paras) {
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-      if (egl_render.decoder_type == SOFTWARE) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, (i > 0 && !isYUV444) ? egl_base.width / 2 : egl_base.width, (i > 0 && !isYUV444) ? egl_base.height / 2 : egl_base.height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, 0);
-      }
   }
 
   // for software render ,because we want cut the not needed view range
@@ -612,16 +851,71 @@ static inline void draw_texture() {
   if (planeNum >= 3) {
     glUniform1i(texture_uniform[FRAG_PARAM_PLANE2], 2);
     glUniform1f(texture_uniform[FRAG_PARAM_CUTWIDTH], egl_base.cutwidth);
+    glUniform2fv(texture_uniform[FRAG_PARAM_DEPTHSCALE], 1, depthScale);
   }
 
   glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 }
 
-static inline void egl_draw_soft(uint8_t* image[3]) {
+// copy the frame into the next upload buffer and leave it bound,
+// the texture update from it then runs on the gpu
+static inline bool egl_fill_upload_buffer(uint8_t* image[3], const int linesize[3]) {
   for (int i = 0; i < 3; i++) {
+    size_t end = i < 2 ? egl_base.uploadOffset[i + 1] : egl_base.uploadSize;
+    if (linesize[i] <= 0 || egl_base.uploadOffset[i] + (size_t)linesize[i] * egl_soft_plane_height(i) > end)
+      return false;
+  }
+
+  struct Upload_Buffer *upload = &egl_base.upload[egl_base.uploadNext];
+  if (upload->fence) {
+    GLenum res = glClientWaitSync(upload->fence, GL_SYNC_FLUSH_COMMANDS_BIT, UPLOAD_FENCE_TIMEOUT);
+    if (res != GL_ALREADY_SIGNALED && res != GL_CONDITION_SATISFIED)
+      return false;
+    glDeleteSync(upload->fence);
+    upload->fence = NULL;
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pbo);
+  uint8_t *dst = upload->map;
+  if (!egl_base.uploadPersistent) {
+    // the fence already tells the gpu is done with it
+    dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, egl_base.uploadSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (dst == NULL) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      return false;
+    }
+  }
+
+  for (int i = 0; i < 3; i++)
+    memcpy(dst + egl_base.uploadOffset[i], image[i], (size_t)linesize[i] * egl_soft_plane_height(i));
+  if (!egl_base.uploadPersistent)
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+  return true;
+}
+
+static inline void egl_draw_soft(struct Render_Image *images) {
+  uint8_t **image = images->sframe.frame_data;
+  const int *linesize = ((AVFrame *)images->sframe.frame)->linesize;
+  // falls back to uploading from client memory
+  bool pbo = egl_base.uploadSize > 0 && egl_fill_upload_buffer(image, linesize);
+
+  for (int i = 0; i < 3; i++) {
+    int rowLength = linesize[i] / egl_base.softBytes;
+    int width = (i > 0 && !isYUV444) ? egl_base.width / 2 : egl_base.width;
     glActiveTexture(GL_TEXTURE0 + i);
     glBindTexture(GL_TEXTURE_2D, texture_id[i]);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (i > 0 && !isYUV444) ? egl_base.width / 2 : egl_base.width, (i > 0 && !isYUV444) ? egl_base.height / 2 : egl_base.height, GL_LUMINANCE, GL_UNSIGNED_BYTE, image[i]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width < rowLength ? width : rowLength, egl_soft_plane_height(i), egl_base.softFormat, egl_base.softType,
+                    pbo ? (const void *)(uintptr_t)egl_base.uploadOffset[i] : image[i]);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+  if (pbo) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    struct Upload_Buffer *upload = &egl_base.upload[egl_base.uploadNext];
+    upload->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    egl_base.uploadNext = (egl_base.uploadNext + 1) % UPLOAD_BUFFER_NUM;
   }
 
   draw_texture();
@@ -680,15 +974,14 @@ static int egl_choose_config_from_frame(struct Render_Config *config) {
     // only x11 platform
     yuvOrder = plane_order[YUVX_ORDER]; 
     planeNum = 3;
+    if (egl_alloc_soft_textures(config->pix_fmt, fullRange, config->linesize) < 0)
+      return -1;
   }
 
   return 0;
 }
 
 static int egl_draw(struct Render_Image *images) {
-  if (eglsync != EGL_NO_SYNC)
-    eglDestroySync(display, eglsync);
-
   if (egl_base.display_buffer) {
     egl_base.back_out_fb = &out_fb[images->index];
     glBindFramebuffer(GL_FRAMEBUFFER, egl_base.back_out_fb->framebuffer);
@@ -703,42 +996,57 @@ static int egl_draw(struct Render_Image *images) {
     egl_draw_vaapi(images);
   }
   else {
-    egl_draw_soft(images->sframe.frame_data);
+    egl_draw_soft(images);
   }
 
   glBindVertexArray(0);
 
-  eglsync = eglCreateSync(display, EGL_SYNC_FENCE, NULL);
-
   if (!egl_base.display_buffer) {
     eglSwapBuffers(display, surface);
   }
   else {
+    // the commands are queued in order, so the old fence of this buffer is not needed anymore
+    if (drawSync[images->index] != EGL_NO_SYNC)
+      eglDestroySync(display, drawSync[images->index]);
+    drawSync[images->index] = eglCreateSync(display, EGL_SYNC_FENCE, NULL);
     glFlush();
   }
 
-  if (egl_base.eglVSync) {
-    if (eglsync != EGL_NO_SYNC) {
-      // wait 5 second,will exit when expired
-      if (eglClientWaitSync(display, eglsync, EGL_SYNC_FLUSH_COMMANDS_BIT, 5000000000) == EGL_TIMEOUT_EXPIRED) {
-        return -1;
-      }
-    }
+  return images->index;
+}
+
+static int egl_wait(struct Render_Image *images) {
+  EGLSync sync = drawSync[images->index];
+  // without vsync the image goes out as soon as it is queued, like swapping with interval 0
+  if (sync == EGL_NO_SYNC || !egl_base.eglVSync)
+    return 0;
+
+  // wait 5 second,will exit when expired
+  if (eglClientWaitSync(display, sync, 0, 5000000000) == EGL_TIMEOUT_EXPIRED) {
+    fprintf(stderr, "EGL: drawing the frame did not finish in time\n");
+    return -1;
   }
+  // the display owns the image now, showing it again needs no wait
+  eglDestroySync(display, sync);
+  drawSync[images->index] = EGL_NO_SYNC;
+  return 1;
+}
 
-  return images->index;
+static void egl_destroy_syncs() {
+  for (int i = 0; i < MAX_FB_NUM; i++) {
+    if (drawSync[i] != EGL_NO_SYNC)
+      eglDestroySync(display, drawSync[i]);
+    drawSync[i] = EGL_NO_SYNC;
+  }
 }
 
 static void egl_destroy() {
-  if (!egl_base.eglVSync) {
-    if (eglsync != EGL_NO_SYNC) {
-      eglClientWaitSync(display, eglsync, EGL_SYNC_FLUSH_COMMANDS_BIT, EGL_FOREVER);
-    }
-  }
-  if (eglsync != EGL_NO_SYNC)
-    eglDestroySync(display, eglsync);
+  egl_destroy_syncs();
   if (egl_base.width != 0) {
     eglMakeCurrent(display, surface, surface, context);
+    // nothing waited for the last draws, they may still read the textures freed below
+    if (!egl_base.eglVSync)
+      glFinish();
     if (egl_base.display_buffer) {
       glBindFramebuffer(GL_FRAMEBUFFER, 0);
       for (int i = 0; i < egl_base.displayBufferNum; i++) {
@@ -750,6 +1058,7 @@ static void egl_destroy() {
       }
     }
     glDeleteTextures(egl_max_planes, texture_id);
+    egl_destroy_upload_buffers();
     glBindVertexArray(0);
     glDeleteBuffers(1,&egl_base.VAO);
     glDeleteShader(egl_base.common_vertex_shader);
@@ -789,6 +1098,7 @@ struct RENDER_CALLBACK egl_render = {
   .render_init = egl_init,
   .render_sync_config = egl_choose_config_from_frame,
   .render_draw = egl_draw,
+  .render_wait = egl_wait,
   .render_destroy = egl_destroy,
   .render_map_buffer = egl_map_buffer_to_eglimage,
   .render_unmap_buffer = egl_unmap_eglimage,
@@ -36,12 +36,48 @@
 #ifndef EGL_OPENGL_ES3_BIT_KHR
 #define EGL_OPENGL_ES3_BIT_KHR 0x0040
 #endif
+#ifndef GL_R16_EXT
+#define GL_R16_EXT 0x822A
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT_EXT
+#define GL_MAP_PERSISTENT_BIT_EXT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT_EXT
+#define GL_MAP_COHERENT_BIT_EXT 0x0080
+#endif
+
+// pixel buffers the software frames are uploaded through
+#define UPLOAD_BUFFER_NUM 3
+
+// linked programs are cached in the moonlight cache directory
+#define SHADER_CACHE_FILE "egl_shaders.bin"
+#define SHADER_CACHE_MAGIC 0x4353474d
+#define SHADER_CACHE_MAX_SIZE (16 * 1024 * 1024)
+#define SHADER_PROGRAM_NUM 3
+
+struct Shader_Cache_Header {
+  uint32_t magic;
+  uint64_t key;
+};
+
+struct Shader_Cache_Entry {
+  uint32_t format;
+  uint32_t length;
+};
 
 struct EXTSTATE {
   bool eglIsSupportExtDmaBuf;
   bool eglIsSupportExtDmaBufMod;
   bool eglIsSupportExtSurfaceless;
   bool eglIsSupportExtImageOES;
+  bool glIsSupportExtBufferStorage;
+  bool glIsSupportExtNorm16;
+};
+
+struct Upload_Buffer {
+  GLuint pbo;
+  GLsync fence;
+  uint8_t *map;
 };
 
 struct Import_Buffer_Info {
@@ -73,6 +109,14 @@ struct EGL_Base {
   bool fixed_resolution;
   bool fill_resolution;
   struct Import_Buffer_Info *back_out_fb;
+  struct Upload_Buffer upload[UPLOAD_BUFFER_NUM];
+  int uploadNext;
+  size_t uploadOffset[3];
+  size_t uploadSize;
+  bool uploadPersistent;
+  int softBytes;
+  GLenum softFormat;
+  GLenum softType;
 };
 
 struct EGLImage_Attrs_Slot {
@@ -24,6 +24,7 @@
 #define FRAG_PARAM_PLANE1 4
 #define FRAG_PARAM_PLANE2 5
 #define FRAG_PARAM_CUTWIDTH 6
+#define FRAG_PARAM_DEPTHSCALE 7
 
 static const char* vertex_source = {
 "#version 300 es\n"
@@ -38,9 +39,11 @@ static const char* vertex_source = {
 "}\n"
 };
 
+// deeper samples arrive as r16 or split into rg8, depthscale maps them
+// to the 8 bit range the matrices and offsets are made for
 static const char* fragment_source_3plane = {
 "#version 300 es\n"
-"precision mediump float;\n"
+"precision highp float;\n"
 "out vec4 FragColor;\n"
 "\n"
 "in vec2 tex_position;\n"
@@ -52,6 +55,7 @@ static const char* fragment_source_3plane = {
 "uniform sampler2D umap;\n"
 "uniform sampler2D vmap;\n"
 "uniform float cutwidth;\n"
+"uniform vec2 depthscale;\n"
 "\n"
 "void main() {\n"
 "  if (tex_position.x > cutwidth) {\n"
@@ -59,9 +63,9 @@ static const char* fragment_source_3plane = {
 "    return;\n"
 "  }\n"
 "  vec3 YCbCr = vec3(\n"
-"    texture2D(ymap, tex_position).r,\n"
-"    texture2D(umap, tex_position).r,\n"
-"    texture2D(vmap, tex_position).r\n"
+"    dot(texture2D(ymap, tex_position).rg, depthscale),\n"
+"    dot(texture2D(umap, tex_position).rg, depthscale),\n"
+"    dot(texture2D(vmap, tex_position).rg, depthscale)\n"
 "  );\n"
 "\n"
 "  YCbCr -= offset;\n"
@@ -20,8 +20,10 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/mastering_display_metadata.h>
+#include <libavutil/hwcontext_drm.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -30,6 +32,7 @@
 #include "video_internal.h"
 #include "ffmpeg.h"
 #include "ffmpeg_hw.h"
+#include "../avsync.h"
 #ifdef HAVE_FFMPEGFILTER
 #include "ffmpeg_filter.h"
 #endif
@@ -45,6 +48,8 @@ static int render_type;
 int supportedVideoFormat = 0;
 bool supportedHDR = false;
 bool wantHdr = false;
+int videoBufferNum = DEFAULT_FB_NUM;
+const char *videoCacheDir = NULL;
 bool wantYuv444 = false;
 bool isYUV444 = false;
 bool useHdr = false;
@@ -55,64 +60,123 @@ uint16_t ffmpeg_hdr_metadata[12] = {0};
 
 static int (*ffmpeg_get_frame_function) (AVFrame *frame, bool native_frame);
 
-static inline int ffmpeg_attach_hdr10_metadata (AVFrame *frame) {
-  if (av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA) == NULL) {
+// Host HDR metadata as last seen, its side data is only rebuilt when the host changes it
+static SS_HDR_METADATA hdr_cached;
+static bool hdr_cached_valid = false;
+static AVBufferRef *hdr_mastering_buf = NULL;
+static AVBufferRef *hdr_light_buf = NULL;
+// Side data rebuilds against HDR frames, and the small allocations that attaching the
+// cached buffers still costs per frame: the AVBufferRef, the side data entry and the
+// grown side data array of the frame
+#define HDR_ATTACH_ALLOCS 3
+static unsigned long hdr_frames = 0;
+static unsigned long hdr_rebuilds = 0;
+static unsigned long hdr_frame_allocs = 0;
+
+static void ffmpeg_clear_hdr10_metadata () {
+  av_buffer_unref(&hdr_mastering_buf);
+  av_buffer_unref(&hdr_light_buf);
+  hdr_cached_valid = false;
+}
 
-    SS_HDR_METADATA data;
-    if (LiGetHdrMetadata(&data)) {
-      AVMasteringDisplayMetadata *mastering = av_mastering_display_metadata_create_side_data(frame);
-      if (mastering == NULL) {
-        fprintf(stderr, "Cannot get metadata ptr from frame.\n");
-        return -1;
-      }
-      mastering->display_primaries[0][0] = av_make_q(data.displayPrimaries[0].x, 50000);
-      mastering->display_primaries[0][1] = av_make_q(data.displayPrimaries[0].y, 50000);
-      mastering->display_primaries[1][0] = av_make_q(data.displayPrimaries[1].x, 50000);
-      mastering->display_primaries[1][1] = av_make_q(data.displayPrimaries[1].y, 50000);
-      mastering->display_primaries[2][0] = av_make_q(data.displayPrimaries[2].x, 50000);
-      mastering->display_primaries[2][1] = av_make_q(data.displayPrimaries[2].y, 50000);
+static int ffmpeg_update_hdr10_metadata () {
+  SS_HDR_METADATA data;
+  if (!LiGetHdrMetadata(&data)) {
+    ffmpeg_clear_hdr10_metadata();
+    return 0;
+  }
+  if (hdr_cached_valid && memcmp(&data, &hdr_cached, sizeof(data)) == 0)
+    return 0;
+
+  ffmpeg_clear_hdr10_metadata();
+  hdr_rebuilds++;
+
+  AVMasteringDisplayMetadata *mastering = av_mastering_display_metadata_alloc();
+  if (mastering == NULL || (hdr_mastering_buf = av_buffer_create((uint8_t *)mastering, sizeof(*mastering), NULL, NULL, 0)) == NULL) {
+    av_free(mastering);
+    fprintf(stderr, "Cannot allocate mastering display metadata.\n");
+    return -1;
+  }
+  mastering->display_primaries[0][0] = av_make_q(data.displayPrimaries[0].x, 50000);
+  mastering->display_primaries[0][1] = av_make_q(data.displayPrimaries[0].y, 50000);
+  mastering->display_primaries[1][0] = av_make_q(data.displayPrimaries[1].x, 50000);
+  mastering->display_primaries[1][1] = av_make_q(data.displayPrimaries[1].y, 50000);
+  mastering->display_primaries[2][0] = av_make_q(data.displayPrimaries[2].x, 50000);
+  mastering->display_primaries[2][1] = av_make_q(data.displayPrimaries[2].y, 50000);
 
-      mastering->white_point[0] = av_make_q(data.whitePoint.x, 50000);
-      mastering->white_point[1] = av_make_q(data.whitePoint.y, 50000);
+  mastering->white_point[0] = av_make_q(data.whitePoint.x, 50000);
+  mastering->white_point[1] = av_make_q(data.whitePoint.y, 50000);
 
-      mastering->min_luminance = av_make_q(data.minDisplayLuminance, 10000);
-      mastering->max_luminance = av_make_q(data.maxDisplayLuminance, 1);
+  mastering->min_luminance = av_make_q(data.minDisplayLuminance, 10000);
+  mastering->max_luminance = av_make_q(data.maxDisplayLuminance, 1);
 
-      mastering->has_luminance = data.maxDisplayLuminance != 0 ? 1 : 0;
-      mastering->has_primaries = data.displayPrimaries[0].x != 0 ? 1 : 0;
+  mastering->has_luminance = data.maxDisplayLuminance != 0 ? 1 : 0;
+  mastering->has_primaries = data.displayPrimaries[0].x != 0 ? 1 : 0;
 
-      uint16_t mcll = data.maxContentLightLevel;
-      uint16_t mfall = data.maxFrameAverageLightLevel;
+  uint16_t maxlight = data.maxDisplayLuminance;
+  uint16_t mcll = data.maxContentLightLevel;
+  uint16_t mfall = data.maxFrameAverageLightLevel;
 #ifdef HAVE_FFMPEGFILTER
-      ffmpeg_filter_caculate_light(&data.maxDisplayLuminance, &mcll, &mfall);
+  ffmpeg_filter_caculate_light(&maxlight, &mcll, &mfall);
 #endif
-      if (mcll > 0 && mfall > 0) {
-        AVContentLightMetadata *light = av_content_light_metadata_create_side_data(frame);
-        if (light == NULL) {
-          fprintf(stderr, "Cannot get light ptr from frame.\n");
-          return -1;
-        }
-        light->MaxCLL = mcll;
-        light->MaxFALL = mfall;
-        if (ffmpeg_hdr_metadata[10] == 0) {
-          ffmpeg_hdr_metadata[10] = light->MaxCLL;
-          ffmpeg_hdr_metadata[11] = light->MaxFALL;
-        }
-      }
+  if (mcll > 0 && mfall > 0) {
+    size_t size;
+    AVContentLightMetadata *light = av_content_light_metadata_alloc(&size);
+    if (light == NULL || (hdr_light_buf = av_buffer_create((uint8_t *)light, size, NULL, NULL, 0)) == NULL) {
+      av_free(light);
+      fprintf(stderr, "Cannot allocate content light metadata.\n");
+      ffmpeg_clear_hdr10_metadata();
+      return -1;
+    }
+    light->MaxCLL = mcll;
+    light->MaxFALL = mfall;
+    if (ffmpeg_hdr_metadata[10] == 0) {
+      ffmpeg_hdr_metadata[10] = light->MaxCLL;
+      ffmpeg_hdr_metadata[11] = light->MaxFALL;
+    }
+  }
 
-      if (ffmpeg_hdr_metadata[0] == 0) {
-        int index = 0;
-        ffmpeg_hdr_metadata[index++] = data.displayPrimaries[0].x;
-        ffmpeg_hdr_metadata[index++] = data.displayPrimaries[0].y;
-        ffmpeg_hdr_metadata[index++] = data.displayPrimaries[1].x;
-        ffmpeg_hdr_metadata[index++] = data.displayPrimaries[1].y;
-        ffmpeg_hdr_metadata[index++] = data.displayPrimaries[2].x;
-        ffmpeg_hdr_metadata[index++] = data.displayPrimaries[2].y;
-        ffmpeg_hdr_metadata[index++] = data.whitePoint.x;
-        ffmpeg_hdr_metadata[index++] = data.whitePoint.y;
-        ffmpeg_hdr_metadata[index++] = data.maxDisplayLuminance;
-        ffmpeg_hdr_metadata[index++] = data.minDisplayLuminance;
-      }
+  if (ffmpeg_hdr_metadata[0] == 0) {
+    int index = 0;
+    ffmpeg_hdr_metadata[index++] = data.displayPrimaries[0].x;
+    ffmpeg_hdr_metadata[index++] = data.displayPrimaries[0].y;
+    ffmpeg_hdr_metadata[index++] = data.displayPrimaries[1].x;
+    ffmpeg_hdr_metadata[index++] = data.displayPrimaries[1].y;
+    ffmpeg_hdr_metadata[index++] = data.displayPrimaries[2].x;
+    ffmpeg_hdr_metadata[index++] = data.displayPrimaries[2].y;
+    ffmpeg_hdr_metadata[index++] = data.whitePoint.x;
+    ffmpeg_hdr_metadata[index++] = data.whitePoint.y;
+    ffmpeg_hdr_metadata[index++] = data.maxDisplayLuminance;
+    ffmpeg_hdr_metadata[index++] = data.minDisplayLuminance;
+  }
+
+  hdr_cached = data;
+  hdr_cached_valid = true;
+  return 0;
+}
+
+static inline int ffmpeg_attach_side_data (AVFrame *frame, enum AVFrameSideDataType type, AVBufferRef *buf) {
+  AVBufferRef *ref = av_buffer_ref(buf);
+  if (ref == NULL || av_frame_new_side_data_from_buf(frame, type, ref) == NULL) {
+    av_buffer_unref(&ref);
+    return -1;
+  }
+  hdr_frame_allocs += HDR_ATTACH_ALLOCS;
+  return 0;
+}
+
+static inline int ffmpeg_attach_hdr10_metadata (AVFrame *frame) {
+  if (av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA) == NULL) {
+    hdr_frames++;
+    if (ffmpeg_update_hdr10_metadata() < 0)
+      return -1;
+    if (!hdr_cached_valid)
+      return 0;
+
+    if (ffmpeg_attach_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA, hdr_mastering_buf) < 0 ||
+        (hdr_light_buf != NULL && ffmpeg_attach_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL, hdr_light_buf) < 0)) {
+      fprintf(stderr, "Cannot attach HDR metadata to frame.\n");
+      return -1;
     }
   }
 
@@ -120,6 +184,8 @@ static inline int ffmpeg_attach_hdr10_metadata (AVFrame *frame) {
 }
 
 static inline void ffmpeg_detach_hdr10_metadata (AVFrame *frame) {
+  if (frame->nb_side_data == 0)
+    return;
   av_frame_remove_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
   av_frame_remove_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
   return;
@@ -416,6 +482,10 @@ void ffmpeg_destroy(void) {
     dec_frames = NULL;
   }
   hw_destroy();
+  if (hdr_frames > 0)
+    printf("HDR metadata: %lu side data rebuilds, %lu attach allocations over %lu frames\n", hdr_rebuilds, hdr_frame_allocs, hdr_frames);
+  ffmpeg_clear_hdr10_metadata();
+  hdr_frames = hdr_rebuilds = hdr_frame_allocs = 0;
   decoder_ctx = NULL;
   decoder = NULL;
 }
@@ -440,6 +510,8 @@ static inline int ffmpeg_decode_packet(unsigned char* indata, int inlen, int fla
   pkt->data = indata;
   pkt->size = inlen;
   pkt->flags = flags;
+  // Carried to the decoded frame so the presentation latency can be measured
+  pkt->pts = avsync_time_us();
 
   err = avcodec_send_packet(decoder_ctx, pkt);
   av_packet_unref(pkt);
@@ -464,6 +536,17 @@ int ffmpeg_is_frame_full_range(const AVFrame* frame) {
   return frame->color_range == AVCOL_RANGE_JPEG ? 1 : 0;
 }
 
+// only prime frames carry their layout, other hardware frames are known after mapping them
+bool ffmpeg_get_frame_modifier(const AVFrame* frame, uint64_t *modifier) {
+  if (frame->format != AV_PIX_FMT_DRM_PRIME || frame->data[0] == NULL)
+    return false;
+  const AVDRMFrameDescriptor *desc = (const AVDRMFrameDescriptor *)frame->data[0];
+  if (desc->nb_objects < 1)
+    return false;
+  *modifier = desc->objects[0].format_modifier;
+  return true;
+}
+
 int ffmpeg_get_frame_colorspace(const AVFrame* frame) {
   switch (frame->colorspace) {
   case AVCOL_SPC_SMPTE170M:
@@ -39,6 +39,7 @@ int ffmpeg_decode(unsigned char* indata, int inlen);
 int ffmpeg_decode2(unsigned char* indata, int inlen, int flags);
 int ffmpeg_is_frame_full_range(const AVFrame* frame);
 int ffmpeg_get_frame_colorspace(const AVFrame* frame);
+bool ffmpeg_get_frame_modifier(const AVFrame* frame, uint64_t *modifier);
 void ffmpeg_get_plane_info (const AVFrame *frame, enum AVPixelFormat *pix_fmt, int *plane_num, enum PixelFormatOrder *plane_order);
 int ffmpeg_supported_video_format(void);
 int ffmpeg_hw_init_lib(const char *device, int device_type);
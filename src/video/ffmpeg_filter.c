@@ -17,6 +17,8 @@
  * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <libavcodec/avcodec.h>
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
@@ -26,7 +28,11 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <Limelight.h>
 #include "video_internal.h"
@@ -45,6 +51,10 @@ struct Filter_Property {
   AVFilterContext *src_ctx;
   AVFilterContext *sink_ctx;
   AVFilterGraph *graph;
+  // Input the graph was configured for, a prebuilt graph is only used when frames still match
+  void *frames_ctx;
+  int width;
+  int height;
 };
 static struct Filter_Property filter_graphs[2] = {0};
 struct Filter_Property *hdr_filter_graph = &filter_graphs[0];
@@ -55,10 +65,83 @@ struct Filter_Desc {
   int index;
 };
 static bool use_hdr_fmt = false;
+// Shared with the decoder, filled from the stream and rewritten by the graph that tonemaps it
+#define HDR_METADATA_NUM 12
 static uint16_t *hdr_metadata_ref = NULL;
 static int sink_flag = AV_BUFFERSINK_FLAG_NO_REQUEST;
 
+// Frames in flight between the decoder thread and the filter thread
+#define FILTER_QUEUE_SIZE 2
+// Frames per timing window, the sync/async choice is revisited after each
+#define FILTER_WINDOW 120
+// Share of the frame interval spent filtering to go async, and to come back
+#define FILTER_ASYNC_LOAD 50
+#define FILTER_SYNC_LOAD 25
+
+struct Filter_Queue {
+  AVFrame *frames[FILTER_QUEUE_SIZE];
+  int head;
+  int count;
+};
+static struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool running;
+  bool stopping;
+  bool async;
+  bool want_sync;
+  bool busy;
+  int error;
+  struct Filter_Queue in;
+  struct Filter_Queue out;
+  AVCodecContext *decoder_ctx;
+} filter_stage = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static struct {
+  unsigned long frames;
+  unsigned long async_frames;
+  uint64_t receive_us;
+  uint64_t filter_us;
+  // Current window, filter time against the time between two delivered frames
+  int window_frames;
+  uint64_t window_filter_us;
+  uint64_t window_interval_us;
+  uint64_t last_delivery_us;
+} filter_stats;
+
+// Builds the graph for the other transfer function in the background,
+// the mutex guards hdr_metadata_ref and sink_flag the builder publishes
+static struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  bool running;
+  struct Filter_Property *target;
+  AVFrame *frame;
+  AVCodecContext *decoder_ctx;
+} graph_builder = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static struct {
+  unsigned long builds;
+  uint64_t build_us;
+  // Time the decoder or filter thread spent waiting for a graph
+  uint64_t stall_us;
+} graph_stats;
+
+static inline uint64_t filter_time_us () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void graph_builder_join () {
+  if (!graph_builder.running)
+    return;
+  pthread_join(graph_builder.thread, NULL);
+  av_frame_free(&graph_builder.frame);
+  graph_builder.running = false;
+}
+
 static inline void destroy_filter_graphs () {
+  graph_builder_join();
   if (hdr_filter_graph->graph) {
     avfilter_graph_free(&hdr_filter_graph->graph);
   }
@@ -137,6 +220,10 @@ struct Color_Args {
   int height;
   bool ishdr;
   bool tosdr;
+  // Private copy of the shared state, published once the graph is configured
+  uint16_t metadata[HDR_METADATA_NUM];
+  bool metadata_changed;
+  int sinkflag;
 };
 
 #define APPEND_DESC(dstdesc, fmt, ...) \
@@ -160,8 +247,12 @@ static inline int deal_filters_args (AVFrame *frame, struct Ffmpeg_Filters_Args
     fprintf(stderr, "Invalied arguments.\n");
     return -1;
   }
+  pthread_mutex_lock(&graph_builder.mutex);
+  memcpy(colors->metadata, hdr_metadata_ref, sizeof(colors->metadata));
+  pthread_mutex_unlock(&graph_builder.mutex);
+  colors->sinkflag = AV_BUFFERSINK_FLAG_NO_REQUEST;
   uint16_t p3_gbrw[8] = { 13250, 34500, 7500, 3000, 34000, 16000, 15635, 16450 };
-  uint16_t bt2020_gbrw[8] = { hdr_metadata_ref[2], hdr_metadata_ref[3], hdr_metadata_ref[4], hdr_metadata_ref[5], hdr_metadata_ref[0], hdr_metadata_ref[1], hdr_metadata_ref[6], hdr_metadata_ref[7] };
+  uint16_t bt2020_gbrw[8] = { colors->metadata[2], colors->metadata[3], colors->metadata[4], colors->metadata[5], colors->metadata[0], colors->metadata[1], colors->metadata[6], colors->metadata[7] };
 
   if (frame->color_trc == AVCOL_TRC_SMPTE2084) {
     colors->ishdr = true;
@@ -177,14 +268,15 @@ static inline int deal_filters_args (AVFrame *frame, struct Ffmpeg_Filters_Args
     memcpy(colors->gbrw, p3_gbrw, sizeof(p3_gbrw));
     // write modified hdr data to shared list
     if (colors->ishdr) {
-      hdr_metadata_ref[0] = p3_gbrw[4];
-      hdr_metadata_ref[1] = p3_gbrw[5];
-      hdr_metadata_ref[2] = p3_gbrw[0];
-      hdr_metadata_ref[3] = p3_gbrw[1];
-      hdr_metadata_ref[4] = p3_gbrw[2];
-      hdr_metadata_ref[5] = p3_gbrw[3];
-      hdr_metadata_ref[6] = p3_gbrw[6];
-      hdr_metadata_ref[7] = p3_gbrw[7];
+      colors->metadata_changed = true;
+      colors->metadata[0] = p3_gbrw[4];
+      colors->metadata[1] = p3_gbrw[5];
+      colors->metadata[2] = p3_gbrw[0];
+      colors->metadata[3] = p3_gbrw[1];
+      colors->metadata[4] = p3_gbrw[2];
+      colors->metadata[5] = p3_gbrw[3];
+      colors->metadata[6] = p3_gbrw[6];
+      colors->metadata[7] = p3_gbrw[7];
     }
   }
   else {
@@ -196,8 +288,8 @@ static inline int deal_filters_args (AVFrame *frame, struct Ffmpeg_Filters_Args
         args->light.maxcll > 0) ||
        args->light.maxlight > 0)) {
     colors->maxlight = args->light.maxlight;
-    colors->minlight = hdr_metadata_ref[9];
-    if (hdr_metadata_ref[10] == 0) {
+    colors->minlight = colors->metadata[9];
+    if (colors->metadata[10] == 0) {
       colors->maxcll = 0;
       colors->maxfall = 0;
     }
@@ -206,22 +298,23 @@ static inline int deal_filters_args (AVFrame *frame, struct Ffmpeg_Filters_Args
       colors->maxfall = args->light.maxfall;
     }
     // write modified hdr data to shared list
-    if (hdr_metadata_ref[8] != 0) {
+    if (colors->metadata[8] != 0) {
       if (colors->ishdr) {
-        printf("Filters will tonemap light(maxcll:maxfall:maxluminance) from %d:%d:%d to %d:%d:%d.\n", hdr_metadata_ref[10], hdr_metadata_ref[11],
-               hdr_metadata_ref[8], colors->maxcll, colors->maxfall, colors->maxlight);
-        hdr_metadata_ref[8] = colors->maxlight;
-        hdr_metadata_ref[9] = colors->minlight;
-        hdr_metadata_ref[10] = colors->maxcll;
-        hdr_metadata_ref[11] = colors->maxfall;
+        printf("Filters will tonemap light(maxcll:maxfall:maxluminance) from %d:%d:%d to %d:%d:%d.\n", colors->metadata[10], colors->metadata[11],
+               colors->metadata[8], colors->maxcll, colors->maxfall, colors->maxlight);
+        colors->metadata_changed = true;
+        colors->metadata[8] = colors->maxlight;
+        colors->metadata[9] = colors->minlight;
+        colors->metadata[10] = colors->maxcll;
+        colors->metadata[11] = colors->maxfall;
       }
     }
   }
   else {
-    colors->maxlight = hdr_metadata_ref[8];
-    colors->minlight = hdr_metadata_ref[9];
-    colors->maxcll = hdr_metadata_ref[10];
-    colors->maxfall = hdr_metadata_ref[11];
+    colors->maxlight = colors->metadata[8];
+    colors->minlight = colors->metadata[9];
+    colors->maxcll = colors->metadata[10];
+    colors->maxfall = colors->metadata[11];
   }
 
   colors->hdrfmt = AV_PIX_FMT_X2RGB10LE;
@@ -247,7 +340,7 @@ static inline int generate_vaapi_desc (int action, struct Filter_Desc *filters_d
   if (colors->ishdr &&
       ((action & FILTER_TONEMAP_LIGHT) ||
        (action & FILTER_TONEMAP_COLOR_PRIMARIES))) {
-    if (hdr_metadata_ref[0] == 0) {
+    if (colors->metadata[0] == 0) {
       fprintf(stderr, "hdr_metadata_ref is not fill correctly.\n");
       return -1;
     }
@@ -259,12 +352,13 @@ static inline int generate_vaapi_desc (int action, struct Filter_Desc *filters_d
     }
     else {
       if (action & FILTER_TONEMAP_FORCE_BT2020) {
-        hdr_metadata_ref[0] = 35400;
-        hdr_metadata_ref[1] = 14600;
-        hdr_metadata_ref[2] = 8500;
-        hdr_metadata_ref[3] = 39850;
-        hdr_metadata_ref[4] = 6550;
-        hdr_metadata_ref[5] = 2300;
+        colors->metadata_changed = true;
+        colors->metadata[0] = 35400;
+        colors->metadata[1] = 14600;
+        colors->metadata[2] = 8500;
+        colors->metadata[3] = 39850;
+        colors->metadata[4] = 6550;
+        colors->metadata[5] = 2300;
         APPEND_DESC(filters_desc[count].desc,
                     "format=%s:primaries=%s:display=%d %d|%d %d|%d %d|%d %d|%d %d",
                     av_get_pix_fmt_name(colors->srcformat), "bt2020",
@@ -312,11 +406,11 @@ static inline int generate_vaapi_desc (int action, struct Filter_Desc *filters_d
 
 static inline int generate_vulkan_desc (int action, struct Filter_Desc *filters_desc, int *filter_count, struct Color_Args *colors) {
   int count = 0;
-  sink_flag = 0;
+  colors->sinkflag = 0;
 
   if (colors->ishdr &&
       (action & FILTER_TONEMAP_COLOR_PRIMARIES)) {
-    if (hdr_metadata_ref[0] == 0) {
+    if (colors->metadata[0] == 0) {
       fprintf(stderr, "hdr_metadata_ref is not fill correctly.\n");
       return -1;
     }
@@ -363,10 +457,9 @@ static inline int generate_vulkan_desc (int action, struct Filter_Desc *filters_
   return 0;
 }
 
-static inline struct Filter_Desc* generate_filters_desc (AVFrame *frame, struct Ffmpeg_Filters_Args *args, int *filter_count) {
+static inline struct Filter_Desc* generate_filters_desc (AVFrame *frame, struct Ffmpeg_Filters_Args *args, int *filter_count, struct Color_Args *colors) {
   enum AVPixelFormat format = frame->format;
-  struct Color_Args colors = {0};
-  if (deal_filters_args(frame, args, &colors) < 0) {
+  if (deal_filters_args(frame, args, colors) < 0) {
     fprintf(stderr, "Filter generator could not fill args.\n");
     return NULL;
   }
@@ -382,11 +475,11 @@ static inline struct Filter_Desc* generate_filters_desc (AVFrame *frame, struct
 
   switch (format) {
   case AV_PIX_FMT_VAAPI:
-    if (generate_vaapi_desc(args->action, filters_desc, filter_count, &colors) == 0)
+    if (generate_vaapi_desc(args->action, filters_desc, filter_count, colors) == 0)
       return filters_desc;
     break;
   case AV_PIX_FMT_VULKAN:
-    if (generate_vulkan_desc(args->action, filters_desc, filter_count, &colors) == 0)
+    if (generate_vulkan_desc(args->action, filters_desc, filter_count, colors) == 0)
       return filters_desc;
     break;
   default:
@@ -467,7 +560,8 @@ static inline int ffmpeg_create_filter_graph(AVFrame *frame, AVCodecContext *dec
 
   AVFilterContext *last_ctx = src_ctx;
   int filter_count = 0;
-  fdesc = generate_filters_desc(frame, &ffmpeg_filters_args, &filter_count);
+  struct Color_Args colors = {0};
+  fdesc = generate_filters_desc(frame, &ffmpeg_filters_args, &filter_count, &colors);
   for (int i = 0; i < filter_count; i++) {
     AVFilterContext* fctx = get_filter(fdesc[i].name, fdesc[i].desc, graph, decoder_ctx->hw_device_ctx);
     if (fctx == NULL) {
@@ -496,9 +590,19 @@ static inline int ffmpeg_create_filter_graph(AVFrame *frame, AVCodecContext *dec
     goto filter_clear;
   }
 
+  // Publish what the filters changed, the builder thread may get here as well
+  pthread_mutex_lock(&graph_builder.mutex);
+  if (colors.metadata_changed)
+    memcpy(hdr_metadata_ref, colors.metadata, sizeof(colors.metadata));
+  sink_flag = colors.sinkflag;
+  pthread_mutex_unlock(&graph_builder.mutex);
+
   filter_props->graph = graph;
   filter_props->src_ctx = src_ctx;
   filter_props->sink_ctx = sink_ctx;
+  filter_props->frames_ctx = frame->hw_frames_ctx->data;
+  filter_props->width = frame->width;
+  filter_props->height = frame->height;
 
 filter_clear:
 
@@ -522,7 +626,9 @@ static inline int pass_frame_to_graph (AVFrame *inframe, AVFilterContext *src_ct
     fprintf(stderr, "Add frame to buffersrc failed: %d.\n", err);
     return err;
   }
+  pthread_mutex_lock(&graph_builder.mutex);
   int sinkflags = sink_flag;
+  pthread_mutex_unlock(&graph_builder.mutex);
   err = av_buffersink_get_frame_flags(sink_ctx, outframe, sinkflags);
   if (err < 0) {
     int times = 0;
@@ -548,36 +654,297 @@ static inline int pass_frame_to_graph (AVFrame *inframe, AVFilterContext *src_ct
   return 0;
 }
 
-static inline int ffmpeg_get_filte_frame(AVFrame *frame, AVCodecContext *decoder_ctx) {
-  int err = -1;
-  AVFilterContext *src_ctx, *sink_ctx;
-  if (filter_frame->color_trc == AVCOL_TRC_SMPTE2084 || filter_frame->color_trc == AVCOL_TRC_ARIB_STD_B67) {
-    if (hdr_filter_graph->graph == NULL) {
-      if (ffmpeg_create_filter_graph(filter_frame, decoder_ctx, hdr_filter_graph) < 0) {
-        fprintf(stderr, "Create hdr filter graph failed.\n");
-        return err;
-      }
+static int ffmpeg_build_filter_graph (AVFrame *frame, AVCodecContext *decoder_ctx, struct Filter_Property *filter_props) {
+  uint64_t start = filter_time_us();
+  int err = ffmpeg_create_filter_graph(frame, decoder_ctx, filter_props);
+  uint64_t elapsed = filter_time_us() - start;
+
+  // Also runs on the builder thread
+  pthread_mutex_lock(&filter_stage.mutex);
+  graph_stats.builds++;
+  graph_stats.build_us += elapsed;
+  pthread_mutex_unlock(&filter_stage.mutex);
+  printf("Filters graph for %s built in %.1f ms.\n", filter_props == hdr_filter_graph ? "hdr" : "sdr", elapsed / 1000.0);
+  return err;
+}
+
+static void* graph_builder_thread (void *data) {
+  pthread_setname_np(pthread_self(), "m_graph_t");
+  ffmpeg_build_filter_graph(graph_builder.frame, graph_builder.decoder_ctx, graph_builder.target);
+  return NULL;
+}
+
+// Prepare the graph for the other transfer function from the frame that built the first one
+static void graph_builder_start (AVFrame *frame, AVCodecContext *decoder_ctx, bool hdr) {
+  struct Filter_Property *target = hdr ? hdr_filter_graph : sdr_filter_graph;
+  if (graph_builder.running || target->graph != NULL || frame->hw_frames_ctx == NULL)
+    return;
+  // Tone mapping needs the host metadata, without it the graph is still built on the first hdr frame
+  pthread_mutex_lock(&graph_builder.mutex);
+  bool metadata = hdr_metadata_ref[0] != 0;
+  pthread_mutex_unlock(&graph_builder.mutex);
+  if (hdr && (!use_hdr_fmt || !metadata))
+    return;
+
+  AVFrame *template = av_frame_alloc();
+  if (template == NULL)
+    return;
+  template->width = frame->width;
+  template->height = frame->height;
+  template->format = frame->format;
+  template->time_base = frame->time_base;
+  template->sample_aspect_ratio = frame->sample_aspect_ratio;
+  template->color_range = frame->color_range;
+  template->color_trc = hdr ? AVCOL_TRC_SMPTE2084 : AVCOL_TRC_IEC61966_2_1;
+  template->colorspace = hdr ? AVCOL_SPC_BT2020_NCL : (frame->colorspace == AVCOL_SPC_BT2020_NCL ? AVCOL_SPC_BT709 : frame->colorspace);
+  template->hw_frames_ctx = av_buffer_ref(frame->hw_frames_ctx);
+  if (template->hw_frames_ctx == NULL) {
+    av_frame_free(&template);
+    return;
+  }
+
+  graph_builder.target = target;
+  graph_builder.frame = template;
+  graph_builder.decoder_ctx = decoder_ctx;
+  if (pthread_create(&graph_builder.thread, NULL, graph_builder_thread, NULL) != 0) {
+    av_frame_free(&graph_builder.frame);
+    return;
+  }
+  graph_builder.running = true;
+}
+
+static struct Filter_Property* ffmpeg_get_filter_graph (AVFrame *frame, AVCodecContext *decoder_ctx, bool hdr) {
+  struct Filter_Property *props = hdr ? hdr_filter_graph : sdr_filter_graph;
+
+  if (graph_builder.running && graph_builder.target == props) {
+    uint64_t start = filter_time_us();
+    graph_builder_join();
+    pthread_mutex_lock(&filter_stage.mutex);
+    graph_stats.stall_us += filter_time_us() - start;
+    pthread_mutex_unlock(&filter_stage.mutex);
+  }
+
+  // A new stream format after the switch makes the prebuilt graph unusable
+  if (props->graph != NULL &&
+      (frame->hw_frames_ctx == NULL || props->frames_ctx != frame->hw_frames_ctx->data ||
+       props->width != frame->width || props->height != frame->height)) {
+    printf("Filters graph for %s no longer matches the frames, rebuilding it.\n", hdr ? "hdr" : "sdr");
+    avfilter_graph_free(&props->graph);
+    memset(props, 0, sizeof(*props));
+  }
+
+  if (props->graph == NULL) {
+    uint64_t start = filter_time_us();
+    int err = ffmpeg_build_filter_graph(frame, decoder_ctx, props);
+    pthread_mutex_lock(&filter_stage.mutex);
+    graph_stats.stall_us += filter_time_us() - start;
+    pthread_mutex_unlock(&filter_stage.mutex);
+    if (err < 0)
+      return NULL;
+    graph_builder_start(frame, decoder_ctx, !hdr);
+  }
+
+  return props;
+}
+
+static inline int ffmpeg_get_filte_frame(AVFrame *inframe, AVFrame *frame, AVCodecContext *decoder_ctx) {
+  bool hdr = inframe->color_trc == AVCOL_TRC_SMPTE2084 || inframe->color_trc == AVCOL_TRC_ARIB_STD_B67;
+  struct Filter_Property *props = ffmpeg_get_filter_graph(inframe, decoder_ctx, hdr);
+  if (props == NULL) {
+    fprintf(stderr, "Create %s filter graph failed.\n", hdr ? "hdr" : "sdr");
+    return -1;
+  }
+  if (!hdr)
+    inframe->color_trc = AVCOL_TRC_IEC61966_2_1;
+
+  return pass_frame_to_graph(inframe, props->src_ctx, frame, props->sink_ctx);
+}
+
+static inline void filter_queue_push (struct Filter_Queue *queue, AVFrame *frame) {
+  av_frame_move_ref(queue->frames[(queue->head + queue->count) % FILTER_QUEUE_SIZE], frame);
+  queue->count++;
+}
+
+static inline void filter_queue_pop (struct Filter_Queue *queue, AVFrame *frame) {
+  av_frame_unref(frame);
+  av_frame_move_ref(frame, queue->frames[queue->head]);
+  queue->head = (queue->head + 1) % FILTER_QUEUE_SIZE;
+  queue->count--;
+}
+
+static void* filter_thread (void *data) {
+  pthread_setname_np(pthread_self(), "m_filter_t");
+  AVFrame *inframe = av_frame_alloc();
+  AVFrame *outframe = av_frame_alloc();
+
+  pthread_mutex_lock(&filter_stage.mutex);
+  while (!filter_stage.stopping) {
+    if (filter_stage.in.count == 0 || filter_stage.out.count == FILTER_QUEUE_SIZE) {
+      pthread_cond_wait(&filter_stage.cond, &filter_stage.mutex);
+      continue;
+    }
+    filter_queue_pop(&filter_stage.in, inframe);
+    filter_stage.busy = true;
+    pthread_cond_broadcast(&filter_stage.cond);
+    pthread_mutex_unlock(&filter_stage.mutex);
+
+    // The graph is only touched here while the stage is async
+    uint64_t start = filter_time_us();
+    int err = ffmpeg_get_filte_frame(inframe, outframe, filter_stage.decoder_ctx);
+    uint64_t elapsed = filter_time_us() - start;
+
+    pthread_mutex_lock(&filter_stage.mutex);
+    filter_stats.filter_us += elapsed;
+    filter_stats.window_filter_us += elapsed;
+    if (err == 0)
+      filter_queue_push(&filter_stage.out, outframe);
+    else if (err < 0)
+      filter_stage.error = err;
+    filter_stage.busy = false;
+    pthread_cond_broadcast(&filter_stage.cond);
+  }
+  pthread_mutex_unlock(&filter_stage.mutex);
+
+  av_frame_free(&inframe);
+  av_frame_free(&outframe);
+  return NULL;
+}
+
+static void filter_stage_free_frames () {
+  for (int i = 0; i < FILTER_QUEUE_SIZE; i++) {
+    av_frame_free(&filter_stage.in.frames[i]);
+    av_frame_free(&filter_stage.out.frames[i]);
+  }
+  memset(&filter_stage.in, 0, sizeof(filter_stage.in));
+  memset(&filter_stage.out, 0, sizeof(filter_stage.out));
+}
+
+static int filter_stage_start () {
+  if (filter_stage.running)
+    return 0;
+
+  for (int i = 0; i < FILTER_QUEUE_SIZE; i++) {
+    if ((filter_stage.in.frames[i] = av_frame_alloc()) == NULL ||
+        (filter_stage.out.frames[i] = av_frame_alloc()) == NULL) {
+      fprintf(stderr, "Alloc filter queue frames failed.\n");
+      filter_stage_free_frames();
+      return -1;
     }
-    src_ctx = hdr_filter_graph->src_ctx;
-    sink_ctx = hdr_filter_graph->sink_ctx;
   }
-  else {
-    if (sdr_filter_graph->graph == NULL) {
-      if (ffmpeg_create_filter_graph(filter_frame, decoder_ctx, sdr_filter_graph) < 0) {
-        fprintf(stderr, "Create sdr filter graph failed.\n");
-        return err;
-      }
+  filter_stage.stopping = false;
+  filter_stage.error = 0;
+  if (pthread_create(&filter_stage.thread, NULL, filter_thread, NULL) != 0) {
+    fprintf(stderr, "Cannot create filter thread, keep filtering on the decoder thread.\n");
+    filter_stage_free_frames();
+    return -1;
+  }
+  filter_stage.running = true;
+  return 0;
+}
+
+static void filter_stage_stop () {
+  if (filter_stage.running) {
+    pthread_mutex_lock(&filter_stage.mutex);
+    filter_stage.stopping = true;
+    pthread_cond_broadcast(&filter_stage.cond);
+    pthread_mutex_unlock(&filter_stage.mutex);
+    pthread_join(filter_stage.thread, NULL);
+    filter_stage.running = false;
+  }
+  filter_stage.async = false;
+  filter_stage.want_sync = false;
+  filter_stage.busy = false;
+  filter_stage_free_frames();
+}
+
+// Called with the stage mutex held for every delivered frame
+static void filter_stage_account () {
+  uint64_t now = filter_time_us();
+  if (filter_stats.last_delivery_us > 0)
+    filter_stats.window_interval_us += now - filter_stats.last_delivery_us;
+  filter_stats.last_delivery_us = now;
+  filter_stats.frames++;
+  if (filter_stage.async)
+    filter_stats.async_frames++;
+
+  if (++filter_stats.window_frames < FILTER_WINDOW)
+    return;
+
+  // Async only pays off when filtering holds the decoder thread back, it delays delivery by up to one frame
+  uint64_t load = filter_stats.window_interval_us > 0 ? filter_stats.window_filter_us * 100 / filter_stats.window_interval_us : 0;
+  if (!filter_stage.async && load > FILTER_ASYNC_LOAD) {
+    if (filter_stage_start() == 0) {
+      filter_stage.async = true;
+      printf("Filters take %d%% of the frame time, moving them to their own thread.\n", (int) load);
+    }
+  }
+  else if (filter_stage.async && load > FILTER_ASYNC_LOAD) {
+    filter_stage.want_sync = false;
+  }
+  else if (filter_stage.async && load < FILTER_SYNC_LOAD) {
+    filter_stage.want_sync = true;
+    printf("Filters take %d%% of the frame time, filtering on the decoder thread again.\n", (int) load);
+  }
+  filter_stats.window_frames = 0;
+  filter_stats.window_filter_us = 0;
+  filter_stats.window_interval_us = 0;
+}
+
+static int ffmpeg_filte_frame_async (AVFrame *frame, int (*decode_frame) (AVFrame *frame, bool native)) {
+  uint64_t start = filter_time_us();
+  int err = decode_frame(filter_frame, true);
+  if (err < 0)
+    return err;
+
+  pthread_mutex_lock(&filter_stage.mutex);
+  // Take a finished frame first, so a filter thread blocked on a full output queue can move on
+  bool delivered = false;
+  if (filter_stage.out.count > 0) {
+    filter_queue_pop(&filter_stage.out, frame);
+    pthread_cond_broadcast(&filter_stage.cond);
+    filter_stage_account();
+    delivered = true;
+  }
+
+  if (err == 0) {
+    filter_stats.receive_us += filter_time_us() - start;
+    while (filter_stage.in.count == FILTER_QUEUE_SIZE && !filter_stage.stopping)
+      pthread_cond_wait(&filter_stage.cond, &filter_stage.mutex);
+    if (!filter_stage.stopping) {
+      filter_queue_push(&filter_stage.in, filter_frame);
+      pthread_cond_broadcast(&filter_stage.cond);
     }
-    src_ctx = sdr_filter_graph->src_ctx;
-    sink_ctx = sdr_filter_graph->sink_ctx;
-    filter_frame->color_trc = AVCOL_TRC_IEC61966_2_1;
   }
 
-  return pass_frame_to_graph(filter_frame, src_ctx, frame, sink_ctx);
+  if (delivered) {
+    err = 0;
+  }
+  else if (filter_stage.error < 0) {
+    err = filter_stage.error;
+    filter_stage.error = 0;
+  }
+  else {
+    err = F_TRY_AGAIN;
+  }
+  pthread_mutex_unlock(&filter_stage.mutex);
+
+  return err;
 }
 
 void ffmpeg_filter_destroy () {
+  filter_stage_stop();
+  if (filter_stats.frames > 0) {
+    printf("Filters: %lu frames, %lu on the filter thread, receive avg %d us, filter avg %d us\n",
+           filter_stats.frames, filter_stats.async_frames,
+           (int) (filter_stats.receive_us / filter_stats.frames), (int) (filter_stats.filter_us / filter_stats.frames));
+  }
+  memset(&filter_stats, 0, sizeof(filter_stats));
   destroy_filter_graphs();
+  if (graph_stats.builds > 0) {
+    printf("Filters: %lu graph builds, avg %.1f ms, decoding stalled %.1f ms for them\n",
+           graph_stats.builds, graph_stats.build_us / 1000.0 / graph_stats.builds, graph_stats.stall_us / 1000.0);
+  }
+  memset(&graph_stats, 0, sizeof(graph_stats));
   if (filter_frame) {
     av_frame_unref(filter_frame);
     av_frame_free(&filter_frame);
@@ -605,19 +972,43 @@ int ffmpeg_init_filter(AVFrame *frame, AVCodecContext *decoder_ctx, bool usehdr,
     fprintf(stderr, "Alloc frame failed.\n");
     return -1;
   }
+  filter_stage.decoder_ctx = decoder_ctx;
   int err = decode_frame(filter_frame, true);
   if (err == 0) {
     if (filter_frame->format < 0)
       return -1;
-    return ffmpeg_get_filte_frame(frame, decoder_ctx);
+    return ffmpeg_get_filte_frame(filter_frame, frame, decoder_ctx);
   }
   return -1;
 }
 
 int ffmpeg_filte_frame(AVFrame *frame, AVCodecContext *decoder_ctx, int (*decode_frame) (AVFrame *frame, bool native)) {
+  if (filter_stage.want_sync) {
+    // Only switch back once nothing is in flight, the graph belongs to one thread at a time
+    pthread_mutex_lock(&filter_stage.mutex);
+    if (filter_stage.in.count == 0 && filter_stage.out.count == 0 && !filter_stage.busy) {
+      filter_stage.async = false;
+      filter_stage.want_sync = false;
+    }
+    pthread_mutex_unlock(&filter_stage.mutex);
+  }
+  if (filter_stage.async)
+    return ffmpeg_filte_frame_async(frame, decode_frame);
+
+  uint64_t start = filter_time_us();
   int err = decode_frame(filter_frame, true);
   if (err == 0) {
-    return ffmpeg_get_filte_frame(frame, decoder_ctx);
+    uint64_t decoded = filter_time_us();
+    err = ffmpeg_get_filte_frame(filter_frame, frame, decoder_ctx);
+    uint64_t elapsed = filter_time_us() - decoded;
+
+    pthread_mutex_lock(&filter_stage.mutex);
+    filter_stats.receive_us += decoded - start;
+    filter_stats.filter_us += elapsed;
+    filter_stats.window_filter_us += elapsed;
+    if (err == 0)
+      filter_stage_account();
+    pthread_mutex_unlock(&filter_stage.mutex);
   }
   return err;
 }
@@ -645,6 +1036,9 @@ int ffmpeg_reject_filter_action (int action) {
 }
 
 void ffmpeg_filter_stop_filte () {
+  // The graph is flushed from this thread, so the filter and builder threads have to be gone first
+  filter_stage_stop();
+  graph_builder_join();
   AVFrame *frame = av_frame_alloc();
   if (hdr_filter_graph->graph) {
     pass_frame_to_graph (NULL, hdr_filter_graph->src_ctx, frame, hdr_filter_graph->sink_ctx);
@@ -534,7 +534,7 @@ static int look_pools (struct Image_Pool *pools, uint8_t *frame_buf) {
     return -1;
 
   if (now->data != frame_buf) {
-    for (int i = 0; i < MAX_POOLS_COUNT; i++) {
+    for (int i = 0; i < pools->count; i++) {
       if (pools->frame_bufs[i] == frame_buf) {
         found = i;
         now->data = frame_buf;
@@ -545,7 +545,7 @@ static int look_pools (struct Image_Pool *pools, uint8_t *frame_buf) {
             first = now;
           }
           else {
-            if (loopindex >= MAX_POOLS_COUNT)
+            if (loopindex >= pools->count)
               found = -1;
             else
               now->next = &looplist[++loopindex];
@@ -712,12 +712,12 @@ int hw_init_lib(const char *device, int hwtype) {
   memset(&descriptors, 0, sizeof(descriptors));
   switch (decontext->ffmpeg_fmt) {
   case AV_PIX_FMT_VAAPI:
-    for (int i = 0; i < MAX_FB_NUM; i++) {
+    for (int i = 0; i < videoBufferNum; i++) {
       primeDescriptors[i] = &descriptors.vaapi_descriptors[i];
     }
     break;
   case AV_PIX_FMT_VULKAN:
-    for (int i = 0; i < MAX_FB_NUM; i++) {
+    for (int i = 0; i < videoBufferNum; i++) {
       descriptors.drm_descriptors[i] = av_frame_alloc();
       primeDescriptors[i] = descriptors.drm_descriptors[i];
     }
@@ -835,14 +835,14 @@ int hw_export_render_images(AVFrame *frame, struct Render_Image *image, int rend
       return -1;
     int index = look_pools(image->images.pools, decontext->get_buf_id(frame));
     if (index < 0) {
-      for (int i = 0; i < MAX_POOLS_COUNT; i++) {
+      for (int i = 0; i < image->images.pools->count; i++) {
         if (image->images.pools->stat[i] == 0) {
           next = i;
           break;
         }
       }
       if (next < 0) {
-        for (int i = 0; i < MAX_POOLS_COUNT; i++) {
+        for (int i = 0; i < image->images.pools->count; i++) {
           if (image->images.pools->image_bufs[i] == image->images.image_data) {
             next = i;
             break;
@@ -859,7 +859,7 @@ int hw_export_render_images(AVFrame *frame, struct Render_Image *image, int rend
           recycle[index] = 0;
         }
         else {
-          for (int i = 0; i < MAX_POOLS_COUNT; i++) {
+          for (int i = 0; i < image->images.pools->count; i++) {
             if (recycle[i] != 0)
               pool_clean(image, i);
           }
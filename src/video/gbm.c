@@ -8,6 +8,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/dma-buf.h>
+#endif
 
 #include "convert.h"
 #include "drm_base.h"
@@ -32,6 +37,29 @@ static int handle_num = 0;
 static bool out_fd = true;
 static uint32_t bo_flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR | GBM_BO_USE_SCANOUT; // must need by egl
 
+// frees the buffers only, the device stays open for another format
+void gbm_destroy_bo (int gbm_fd, void *data, int buffer_num) {
+  struct Gbm_Bo *gbm_bo = (struct Gbm_Bo *)data;
+  for (int i = 0; i < buffer_num; i++) {
+    if (gbm_bo[i].fb_id != 0) {
+      drmModeRmFB(gbm_fd, gbm_bo[i].fb_id);
+    }
+    // planes may share one fd, and handle_num is not set yet when an allocation failed
+    for (int j = 0; j < MAX_PLANE_NUM; j++) {
+      if (gbm_bo[i].fd[j] > 0 && (j == 0 || gbm_bo[i].fd[j] != gbm_bo[i].fd[j - 1]))
+        close(gbm_bo[i].fd[j]);
+    }
+    if (gbm_bo[i].bo != NULL) {
+      gbm_bo_destroy(gbm_bo[i].bo);
+    }
+    memset(&gbm_bo[i], 0, sizeof(gbm_bo[i]));
+  }
+}
+
+static inline bool is_subsampled_format(uint32_t format) {
+  return format == GBM_FORMAT_YUV420 || format == GBM_FORMAT_NV12 || format == DRM_FORMAT_P010;
+}
+
 int generate_gbm_bo(int fd, struct _drm_buf gbm_buf[], int buffer_num, void *display, int width, int height, int src_fmt, uint64_t size[MAX_PLANE_NUM]) {
   struct Gbm_Bo *gbm_bo = (struct Gbm_Bo *)gbm_buf;
   struct gbm_device *gbm_display = (struct gbm_device *)display;
@@ -44,6 +72,7 @@ int generate_gbm_bo(int fd, struct _drm_buf gbm_buf[], int buffer_num, void *dis
     struct gbm_bo *bo = gbm_bo_create(gbm_display, width, height, format, bo_flags);
     if (!bo) {
       fprintf(stderr, "Failed to create a gbm bo.\n");
+      gbm_destroy_bo(fd, gbm_buf, i);
       return -1;
     }
     gbm_bo[i].bo = bo;
@@ -55,10 +84,8 @@ int generate_gbm_bo(int fd, struct _drm_buf gbm_buf[], int buffer_num, void *dis
       gbm_bo[i].handle[k] = gbm_bo_get_handle_for_plane(bo, k).u32;
       gbm_bo[i].pitch[k] = gbm_bo_get_stride_for_plane(bo, k);
       gbm_bo[i].offset[k] = gbm_bo_get_offset(bo, k);
-      gbm_bo[i].width[k] = (k != 0 && (format == GBM_FORMAT_YUV420 ||
-                                       format == GBM_FORMAT_NV12)) ? (int)(width / 2) : width;
-      gbm_bo[i].height[k] = (k != 0 && (format == GBM_FORMAT_YUV420 ||
-                                        format == GBM_FORMAT_NV12)) ? (int)(height / 2) : height;
+      gbm_bo[i].width[k] = (k != 0 && is_subsampled_format(format)) ? (int)(width / 2) : width;
+      gbm_bo[i].height[k] = (k != 0 && is_subsampled_format(format)) ? (int)(height / 2) : height;
       gbm_bo[i].format[k] = format;
       gbm_bo[i].modifiers[k] = modifier;
       size[i] = gbm_bo[i].pitch[k] * gbm_bo[i].height[k];
@@ -133,22 +160,8 @@ void* gbm_get_display(int *fd) {
 
 void gbm_close_display (int gbm_fd, void *data, int buffer_num, void **display, void **window) {
 
-  if (data && gbm_fd >= 0) {
-    struct Gbm_Bo *gbm_bo = (struct Gbm_Bo *)data;
-    for (int i = 0; i < buffer_num; i++) {
-      if (gbm_bo[i].fb_id != 0) {
-        drmModeRmFB(gbm_fd, gbm_bo[i].fb_id);
-      }
-      for (int j = 0; j < handle_num; j++) {
-        if (gbm_bo[i].fd[j] > 0)
-          close(gbm_bo[i].fd[j]);
-      }
-      if (gbm_bo[i].bo != NULL) {
-        gbm_bo_destroy(gbm_bo[i].bo);
-      }
-      memset(&gbm_bo[i], 0, sizeof(gbm_bo[i]));
-    }
-  }
+  if (data && gbm_fd >= 0)
+    gbm_destroy_bo(gbm_fd, data, buffer_num);
 
   if (window && *window) {
     struct gbm_surface *gbm_window = (struct gbm_surface *)(*window);
@@ -166,44 +179,55 @@ void gbm_close_display (int gbm_fd, void *data, int buffer_num, void **display,
   return;
 }
 
+// cpu access brackets for the dmabuf, so caches are flushed before the compositor reads it
+static inline void gbm_sync_plane(int fd, bool start) {
+#ifdef __linux__
+  struct dma_buf_sync sync = { .flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_WRITE };
+  ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+#endif
+}
+
 int gbm_convert_image(struct Render_Image *image, struct _drm_buf *drm_buf, int drm_fd, int handle_num, int plane_num, int dst_fmt, uint64_t size[MAX_PLANE_NUM], uint64_t map_offset[MAX_PLANE_NUM]) {
   AVFrame * sframe = (AVFrame *)image->sframe.frame;
-  struct gbm_bo *bo = (struct gbm_bo *)drm_buf[image->index].data;
+  struct _drm_buf *buf = &drm_buf[image->index];
 
   uint8_t *data_buffer[MAX_PLANE_NUM] = {0};
-  void *mapped_handle[MAX_PLANE_NUM] = {0};
+  void *mapped[MAX_PLANE_NUM] = {0};
+  size_t mapped_size[MAX_PLANE_NUM] = {0};
+  int err = -1;
 
+  // gbm_bo_map only reaches the first plane, the bo is linear so map its dmabufs up to the end of the chroma rows
   for (int m = 0; m < handle_num; m++) {
-    uint32_t stride = 0;
-    void *data_ptr = gbm_bo_map(bo, 0, 0, drm_buf[image->index].width[m], drm_buf[image->index].height[m], GBM_BO_TRANSFER_READ_WRITE, &stride, &mapped_handle[m]);
-    if (!data_ptr) {
+    int last = handle_num == 1 ? plane_num - 1 : m;
+    mapped_size[m] = (size_t)buf->offset[last] + (size_t)buf->pitch[last] * buf->height[last];
+    mapped[m] = mmap(NULL, mapped_size[m], PROT_READ | PROT_WRITE, MAP_SHARED, buf->fd[m], 0);
+    if (mapped[m] == MAP_FAILED) {
+      mapped[m] = NULL;
       fprintf(stderr, "Could not map gbm to userspace.\n");
-      return -1;
+      goto unmap;
     }
+    gbm_sync_plane(buf->fd[m], true);
 
     if (handle_num == 1) {
       for (int i = 0; i < plane_num; i++) {
-        data_buffer[i] = data_ptr + drm_buf[image->index].offset[i];
+        data_buffer[i] = (uint8_t *)mapped[0] + buf->offset[i];
       }
     } else {
-      data_buffer[m] = data_ptr;
+      data_buffer[m] = (uint8_t *)mapped[m] + buf->offset[m];
     }
   }
 
-  int err = convert_frame(sframe, data_buffer, drm_buf[image->index].pitch, dst_fmt);
+  err = convert_frame(sframe, data_buffer, buf->pitch, dst_fmt);
+  if (err != 0)
+    fprintf(stderr, "Convert frame failed.\n");
 
-  if (handle_num == 1) {
-    gbm_bo_unmap(bo, mapped_handle[0]);
-  } else {
-    for (int m = 0; m < handle_num; m++) {
-      gbm_bo_unmap(bo, mapped_handle[m]);
+unmap:
+  for (int m = 0; m < handle_num; m++) {
+    if (mapped[m] != NULL) {
+      gbm_sync_plane(buf->fd[m], false);
+      munmap(mapped[m], mapped_size[m]);
     }
   }
 
-  if (err != 0) {
-    fprintf(stderr, "Convert frame failed.\n");
-    return -1;
-  }
-
-  return image->index;
+  return err != 0 ? -1 : image->index;
 }
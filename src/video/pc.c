@@ -38,6 +38,7 @@
 #include "../config.h"
 #include "../loop.h"
 #include "../util.h"
+#include "../avsync.h"
 
 #define X11_VULKAN_ACCELERATION ENABLE_HARDWARE_ACCELERATION_1
 #define X11_VAAPI_ACCELERATION ENABLE_HARDWARE_ACCELERATION_2
@@ -108,6 +109,7 @@ struct Multi_Thread {
   sem_t decoder_sem;
 };
 static struct Multi_Thread threads = {0};
+static bool asyncDisplay = false;
 
 typedef struct Setupargs {
   int videoFormat;
@@ -135,6 +137,10 @@ static void clear_threads() {
       pthread_join(threads.decoder_id, NULL);
     if (threads.display_id)
       pthread_join(threads.display_id, NULL);
+    // no more images may come back once the semaphores are gone
+    if (asyncDisplay)
+      disPtr->display_set_release(NULL, NULL);
+    asyncDisplay = false;
     sem_destroy(&threads.render_sem);
     sem_destroy(&threads.decoder_sem);
   }
@@ -216,6 +222,7 @@ static inline void* draw_frame (struct Render_Image *images, AVFrame* frame, int
     config.color_space = ffmpeg_get_frame_colorspace(frame);
     config.full_color_range = ffmpeg_is_frame_full_range(frame);
     ffmpeg_get_plane_info(frame, &config.pix_fmt, &config.plane_nums, &config.yuv_order);
+    config.has_modifier = ffmpeg_get_frame_modifier(frame, &config.modifier);
     for (int i = 0; i < config.plane_nums; i++) {
       config.linesize[i] = frame->linesize[i];
     }
@@ -239,6 +246,18 @@ static inline void* draw_frame (struct Render_Image *images, AVFrame* frame, int
   return images;
 }
 
+// the render only queues the drawing, so the display waits for the gpu right before showing it
+static inline int wait_frame_drawn (struct Render_Image *image) {
+  if (renderPtr->render_wait == NULL)
+    return 0;
+
+  uint64_t start = avsync_time_us();
+  int res = renderPtr->render_wait(image);
+  if (res > 0)
+    avsync_video_gpu_waited(avsync_time_us() - start);
+  return res;
+}
+
 static inline void mv_vlist_display_to_decoder() {
   pthread_mutex_lock(&threads.mutex);
   void *image = VLIST_GET_DATA(display);
@@ -295,6 +314,7 @@ static int frame_handle (int pipefd, void *data) {
       return res;
     }
     mv_vlist_render_to_display();
+    if (wait_frame_drawn(image) < 0) return LOOP_RETURN;
 
     if (disPtr->display_vsync_loop) {
       dis_res = disPtr->display_vsync_loop(image, display_width, display_height, image->index);
@@ -309,6 +329,7 @@ static int frame_handle (int pipefd, void *data) {
       }
     }
     if (dis_res < 0) return LOOP_RETURN;
+    avsync_video_presented(frame->pts);
 
     mv_vlist_display_to_decoder();
 
@@ -356,6 +377,9 @@ static void* frame_handler (void *data) {
     }
     mv_vlist_render_to_display();
     if (disPtr->display_vsync_loop == NULL) {
+      if (wait_frame_drawn((struct Render_Image *)image_data) < 0) {
+        break;
+      }
       int dis_res = disPtr->display_put_to_screen(display_width, display_height, ((struct Render_Image *)image_data)->index);
       if (dis_res < 0) {
         break;
@@ -366,6 +390,7 @@ static void* frame_handler (void *data) {
           renderPtr->render_sync_window_size(display_width, display_height, false);
         }
       }
+      avsync_video_presented(frame->pts);
       mv_vlist_display_to_decoder();
     }
   }
@@ -394,7 +419,8 @@ static void* display_handler (void *data) {
     AVFrame *last_frame = VLIST_GET_FRAME(display);
     struct Render_Image *last_image_data = (struct Render_Image *)VLIST_GET_DATA(display);
     int displayNum = VLIST_NUM(display);
-    if (displayNum > (MAX_FB_NUM - 1)) {
+    // every buffer waits for display, keep only the newest one
+    if (displayNum > 2 && displayNum > (videoBufferNum - 1)) {
       VLIST_DEL(display);
       while (VLIST_NUM(display) > 0) {
         AVFrame *middle_frame = VLIST_GET_FRAME(display);
@@ -419,10 +445,13 @@ static void* display_handler (void *data) {
       fprintf(stderr, "Error: Get NULL image data.\n");
       goto display_exit;
     }
+    if (wait_frame_drawn(image_data) < 0)
+      goto display_exit;
     if (disPtr->display_vsync_loop(image_data, display_width, display_height, image_data->index) < 0) {
       fprintf(stderr, "Error: display loop failed.\n");
       goto display_exit;
     }
+    avsync_video_presented(((AVFrame *)image_data->sframe.frame)->pts);
     if (last_image_data != image_data) {
       pthread_mutex_lock(&threads.mutex);
       VLIST_ADD(decoder, last_frame, last_image_data);
@@ -444,6 +473,53 @@ display_exit:
   return NULL;
 }
 
+// called by async displays, possibly from their own thread
+static void release_display_image (void *data) {
+  struct Render_Image *image = (struct Render_Image *)data;
+
+  pthread_mutex_lock(&threads.mutex);
+  VLIST_ADD(decoder, image->sframe.frame, image);
+  pthread_mutex_unlock(&threads.mutex);
+  sem_post(&threads.decoder_sem);
+}
+
+// called by async displays once the image is on the screen, before it is released
+static void present_display_image (void *data, uint64_t present_us) {
+  struct Render_Image *image = (struct Render_Image *)data;
+  avsync_video_presented_at(((AVFrame *)image->sframe.frame)->pts, present_us);
+}
+
+// hands every new image to the display exactly once, it decides when to recycle them
+static void* display_async_handler (void *data) {
+  pthread_setname_np(pthread_self(), "m_display_t");
+
+  while (!done) {
+    pthread_mutex_lock(&threads.mutex);
+    struct Render_Image *image_data = (struct Render_Image *)VLIST_GET_DATA(display);
+    if (image_data != NULL)
+      VLIST_DEL(display);
+    pthread_mutex_unlock(&threads.mutex);
+    if (image_data == NULL) {
+      usleep(fps_time_10);
+      continue;
+    }
+
+    // only queued here, the display reports the presentation once the flip completed
+    if (wait_frame_drawn(image_data) < 0)
+      break;
+    if (disPtr->display_vsync_loop(image_data, display_width, display_height, image_data->index) < 0) {
+      fprintf(stderr, "Error: display loop failed.\n");
+      break;
+    }
+  }
+
+  done = true;
+  sem_post(&threads.decoder_sem);
+  write(windowpipefd[1], &quitstate, sizeof(quitstate));
+
+  return NULL;
+}
+
 // declare funtion here
 int x11_submit_decode_unit(PDECODE_UNIT decodeUnit);
 static void* decoder_thread(void *data) {
@@ -504,6 +580,10 @@ static void* decoder_thread(void *data) {
 int x11_init(const char *displayName, int hwType) {
   int res = 0;
   const char *displayDevice;
+  if (videoBufferNum < MIN_FB_NUM || videoBufferNum > MAX_FB_NUM) {
+    fprintf(stderr, "Video buffers must be between %d and %d, using %d.\n", MIN_FB_NUM, MAX_FB_NUM, DEFAULT_FB_NUM);
+    videoBufferNum = DEFAULT_FB_NUM;
+  }
   // display and decoder may modify supportedVideoFormat
   supportedVideoFormat = (VIDEO_FORMAT_MASK_10BIT | VIDEO_FORMAT_MASK_YUV444 | VIDEO_FORMAT_MASK_H264 | VIDEO_FORMAT_MASK_H265 | VIDEO_FORMAT_MASK_AV1);
 
@@ -540,6 +620,8 @@ int x11_init(const char *displayName, int hwType) {
         continue;
       }
 
+      // drm signals hdr for egl too, which uploads deep software frames as is
+      bool egl_hdr_software = hwType == 0 && strcmp(disPtr->name, "drm") == 0 && strcmp(renderPtr->name, "egl") == 0;
       if (disIndex < 3) {
         bestDisplay[disIndex] = disPtr;
         bestRender[disIndex] = renderPtr;
@@ -548,7 +630,7 @@ int x11_init(const char *displayName, int hwType) {
 
       if ((displayName && renderPtr && strcmp(displayName, "wayland") == 0 && strcmp(renderPtr->name, "wayland") != 0) ||
           (displayName && renderPtr && strcmp(displayName, "drm") == 0 && strcmp(renderPtr->name, "drm") != 0) ||
-          (wantHdr &&  strcmp(disPtr->name, renderPtr->name) != 0)) {
+          (wantHdr && strcmp(disPtr->name, renderPtr->name) != 0 && !egl_hdr_software)) {
         renderPtr->render_destroy();
         renderPtr = NULL;
         continue;
@@ -620,7 +702,7 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
     return -1;
   disPtr->display_get_resolution(&screen_width, &screen_height, true);
   window = disPtr->display_get_window();
-  printf("Based %s window\n", disPtr->name);
+  printf("Based %s window, %d video buffers\n", disPtr->name, videoBufferNum);
 
   if (drFlags & DISPLAY_FULLSCREEN && renderPtr->render_type == EGL_RENDER) {
     display_width = screen_width;
@@ -642,7 +724,7 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
   }
   avc_flags |= renderPtr->render_type;
 
-  if (ffmpeg_init(videoFormat, width, height, avc_flags, MAX_FB_NUM, SLICES_PER_FRAME) < 0) {
+  if (ffmpeg_init(videoFormat, width, height, avc_flags, videoBufferNum, SLICES_PER_FRAME) < 0) {
     fprintf(stderr, "Couldn't initialize video decoding\n");
     return -1;
   }
@@ -650,7 +732,7 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
   ffmpegArgs.width = width;
   ffmpegArgs.height = height;
   ffmpegArgs.avc_flags = avc_flags;
-  ffmpegArgs.buffer_count = MAX_FB_NUM;
+  ffmpegArgs.buffer_count = videoBufferNum;
   ffmpegArgs.thread_count = SLICES_PER_FRAME;
 
   isTenBit = videoFormat & VIDEO_FORMAT_MASK_10BIT;
@@ -695,15 +777,16 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
 
   memset(renderPtr->images, 0, sizeof(struct Render_Image) * MAX_FB_NUM);
 
-  image_pools.image_bufs = calloc(MAX_POOLS_COUNT, sizeof(void *) * MAX_PLANE_NUM);
-  image_pools.frame_bufs = calloc(MAX_POOLS_COUNT, sizeof(uint8_t *));
+  image_pools.count = videoBufferNum * POOLS_PER_FB;
+  image_pools.image_bufs = calloc(image_pools.count, sizeof(void *) * MAX_PLANE_NUM);
+  image_pools.frame_bufs = calloc(image_pools.count, sizeof(uint8_t *));
   if (image_pools.image_bufs == NULL || image_pools.frame_bufs == NULL) {
     fprintf(stderr, "Alloc pools for image pools failed.\n");
     return -1;
   }
   // file vlist quene
   AVFrame **frames = ffmpeg_get_frames();
-  for (int i = 0; i < MAX_FB_NUM; i++) {
+  for (int i = 0; i < videoBufferNum; i++) {
     VLIST_ADD(decoder, frames[i], &renderPtr->images[i]);
     renderPtr->images[i].images.pools = &image_pools;
     renderPtr->images[i].images.image_data = image_pools.image_bufs[i];
@@ -734,8 +817,13 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
     threads.frame_handler = frame_handler;
     threads.decoder_handler = decoder_thread;
     threads.display_handler = display_handler;
+    if (disPtr->display_vsync_loop != NULL && disPtr->display_set_release != NULL &&
+        disPtr->display_set_release(&release_display_image, &present_display_image) == 0) {
+      asyncDisplay = true;
+      threads.display_handler = display_async_handler;
+    }
     sem_init(&threads.render_sem, 0, 0);
-    sem_init(&threads.decoder_sem, 0, MAX_FB_NUM);
+    sem_init(&threads.decoder_sem, 0, videoBufferNum);
     if (disPtr->display_vsync_loop != NULL &&
         pthread_create(&threads.display_id, NULL, threads.display_handler, &pipefd[0]) != 0) {
       fprintf(stderr, "Error: Cannot create dislpay thread! Please try again or try direct submit mode.\n");
@@ -795,8 +883,8 @@ void x11_cleanup() {
   if (renderPtr) {
     struct Render_Image *image = &renderPtr->images[0];
     if (image->images.free && image->images.layers > 0) {
-      for (int i = 0; i < MAX_POOLS_COUNT; i++) {
-        if (i < MAX_FB_NUM || image_pools.stat[i] != 0)
+      for (int i = 0; i < image_pools.count; i++) {
+        if (i < videoBufferNum || image_pools.stat[i] != 0)
           image->images.free(image_pools.image_bufs[i], image->images.layers);
       }
     }
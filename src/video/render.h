@@ -33,6 +33,9 @@ struct Render_Config {
   bool use_hdr;
   bool vsync;
   int linesize[MAX_PLANE_NUM];
+  // layout of hardware frames, when the decoder exports it
+  bool has_modifier;
+  uint64_t modifier;
 };
 struct Render_Init_Info {
   int frame_width;
@@ -63,6 +66,8 @@ struct RENDER_CALLBACK {
   int (*render_init) (struct Render_Init_Info *paras);
   int (*render_sync_config) (struct Render_Config *config);
   int (*render_draw) (struct Render_Image *image);
+  // optional, blocks until the image was drawn, returns 1 when it had a fence
+  int (*render_wait) (struct Render_Image *image);
   void (*render_destroy) ();
   int (*render_map_buffer) (struct Source_Buffer_Info *buffer, int planes, int layers, void* image[MAX_PLANE_NUM], int index);
   void (*render_unmap_buffer) (void* image[MAX_PLANE_NUM], int planes);
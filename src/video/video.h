@@ -32,6 +32,7 @@
 #define FILL_RESOLUTION 0x80
 // 0x0F00 is render type
 #define MODESET 0x2000
+#define VRR 0x4000
 #define FILTER_FLAGS 0xF0000
 #define FILTER_TONEMAP_COLOR_PRIMARIES 0x10000
 #define FILTER_TONEMAP_LIGHT 0x20000
@@ -87,3 +88,5 @@ extern int supportedVideoFormat;
 extern bool supportedHDR;
 extern bool wantYuv444;
 extern bool wantHdr;
+extern int videoBufferNum;
+extern const char *videoCacheDir;
@@ -34,9 +34,13 @@ enum decoders {SOFTWARE = 0, VULKAN, VAAPI};
 #define F_TRY_AGAIN 1
 #define F_RESET_TRY_AGAIN 2
 
-#define MAX_FB_NUM 3
+// the pipeline depth is videoBufferNum, MAX_FB_NUM only sizes the arrays
+#define MIN_FB_NUM 2
+#define DEFAULT_FB_NUM 3
+#define MAX_FB_NUM 6
 #define MAX_PLANE_NUM 4
-#define MAX_POOLS_COUNT (MAX_FB_NUM * 3)
+#define POOLS_PER_FB 3
+#define MAX_POOLS_COUNT (MAX_FB_NUM * POOLS_PER_FB)
 
 #define GET_FB_NEXT(nowindex, maxnum) ((nowindex) >= (maxnum - 1) ? 0 : (nowindex + 1))
 #define MV_FB_MEM_SIMPLE(object, size) \
@@ -102,6 +106,7 @@ struct Image_Pool {
   void *(*image_bufs)[MAX_PLANE_NUM];
   uint8_t **frame_bufs;
   uint8_t stat[MAX_POOLS_COUNT];
+  int count;
 };
 
 struct Render_Image {
@@ -34,6 +34,7 @@
 #include "zwp-pointer-constraints.h"
 #include "zwp-relative-pointer.h"
 #include "../input/evdev.h"
+#include "../input/latency.h"
 
 #include "render.h"
 #include "drm.h"
@@ -302,6 +303,7 @@ static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t t
     if (abs(motion_x) > 0 || abs(motion_y) > 0) {
       if (last_x >= 0 && last_y >= 0 && inputing) {
         LiSendMouseMoveAsMousePositionEvent(motion_x, motion_y, display_width, display_height);
+        input_latency_record_ms(INPUT_LATENCY_MOUSE, time);
       }
     }
   
@@ -335,6 +337,7 @@ static void zwp_relative_motion(void *data, struct zwp_relative_pointer_v1 *zwp_
                                 wl_fixed_t dx_unaccel, wl_fixed_t dy_unaccel) {
   if (isGrabing && inputing) {
     LiSendMouseMoveEvent(wl_fixed_to_int(dx_unaccel), wl_fixed_to_int(dy_unaccel));
+    input_latency_record_us(INPUT_LATENCY_MOUSE, (uint64_t) utime_hi << 32 | utime_lo);
   }
 }
 
@@ -1116,6 +1119,57 @@ static inline struct wl_buffer *wl_import_dmabuf(struct _drm_buf *drm_buf) {
   return buffer;
 }
 
+static inline bool wl_is_format_supported(uint32_t format) {
+  for (int p = 0; p < wl_render_base.supported_format_count; p++) {
+    if (wl_render_base.supported_format[p] == format)
+      return true;
+  }
+  return false;
+}
+
+// returns the planes of the first yuv format the compositor takes, or -1 to fall back to rgb
+static int wl_generate_yuv_bo(struct Render_Config *config, int *dst_fmt) {
+  int candidates[2] = { -1, -1 };
+  switch (config->pix_fmt) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+    candidates[0] = config->pix_fmt;
+    candidates[1] = AV_PIX_FMT_NV12;
+    break;
+  case AV_PIX_FMT_YUV420P10:
+    candidates[0] = AV_PIX_FMT_P010;
+    break;
+  case AV_PIX_FMT_YUV444P:
+  case AV_PIX_FMT_YUVJ444P:
+  case AV_PIX_FMT_YUV444P10:
+    candidates[0] = config->pix_fmt;
+    break;
+  default:
+    return -1;
+  }
+
+  // without a format table there is no telling whether yuv is accepted
+  if (wl_render_base.supported_format == NULL)
+    return -1;
+
+  for (int i = 0; i < sizeof(candidates) / sizeof(candidates[0]) && candidates[i] >= 0; i++) {
+    int bpp, buffer_multi, plane_num;
+    uint32_t format = translate_format_to_drm(candidates[i], &bpp, &buffer_multi, &plane_num);
+    if (format == 0 || !wl_is_format_supported(format))
+      continue;
+
+    int planes = generate_gbm_bo(wl_render_base.drm_fd, wl_render_base.drm_buf, videoBufferNum, wl_render_base.gbm_device, config->width, config->height, candidates[i], wl_render_base.size);
+    if (planes < 1)
+      continue;
+
+    *dst_fmt = candidates[i];
+    printf("wl: software frames are shown as %.4s buffers\n", (char *)&format);
+    return planes;
+  }
+
+  return -1;
+}
+
 static int wl_sync_frame_config(struct Render_Config *config) {
   int dst_fmt = -1;
   int colorspace = config->color_space;
@@ -1133,17 +1187,23 @@ static int wl_sync_frame_config(struct Render_Config *config) {
     }
     dst_fmt = config->pix_fmt;
   } else {
-    if (useHdr)
-      dst_fmt = AV_PIX_FMT_X2RGB10LE;
-    else
-      dst_fmt = AV_PIX_FMT_BGR0;
+    // yuv buffers are only filled with the planes, the compositor converts them
+    wl_render_base.plane_num = wl_generate_yuv_bo(config, &dst_fmt);
+    if (wl_render_base.plane_num > 0) {
+      wl_render_base.lastcolorspace = colorspace;
+    } else {
+      if (useHdr)
+        dst_fmt = AV_PIX_FMT_X2RGB10LE;
+      else
+        dst_fmt = AV_PIX_FMT_BGR0;
 
-    wl_render_base.plane_num = generate_gbm_bo(wl_render_base.drm_fd, wl_render_base.drm_buf, MAX_FB_NUM, wl_render_base.gbm_device, config->width, config->height, dst_fmt, wl_render_base.size);
+      wl_render_base.plane_num = generate_gbm_bo(wl_render_base.drm_fd, wl_render_base.drm_buf, videoBufferNum, wl_render_base.gbm_device, config->width, config->height, dst_fmt, wl_render_base.size);
+    }
     if (wl_render_base.plane_num < 1) {
       fprintf(stderr, "Could not generate drm buf.\n");
       return -1;
     }
-    for (int bufferc = 0; bufferc < MAX_FB_NUM; bufferc++) {
+    for (int bufferc = 0; bufferc < videoBufferNum; bufferc++) {
       struct wl_buffer *buffer = wl_import_dmabuf(&wl_render_base.drm_buf[bufferc]);
       if (buffer == NULL) {
         fprintf(stderr, "Create wayland linux dmabuf failed.\n");
@@ -1155,11 +1215,7 @@ static int wl_sync_frame_config(struct Render_Config *config) {
   wl_render_base.dst_fmt = dst_fmt;
 
   if (wl_render_base.supported_format) {
-    int found = -1;
-    for (int p = 0; p < wl_render_base.supported_format_count; p++) {
-      if (wl_render_base.supported_format[p] == wl_render_base.drm_buf[0].format[0]) found = p;
-    }
-    if (found < 0) {
+    if (!wl_is_format_supported(wl_render_base.drm_buf[0].format[0])) {
       fprintf(stderr, "ERROR: wayland linux dmabuf not support the drm format: %.4s.\n", (char *)&wl_render_base.drm_buf[0].format[0]);
       fprintf(stderr, "Please try add '-filters scale:fmt' option to cmd.\n");
       return -1;
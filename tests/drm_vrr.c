@@ -0,0 +1,94 @@
+#include "drm_vrr.h"
+#include "drm_commit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static int failures = 0;
+
+// Stands in for the commit list of drm_base.c
+static struct { int calls; enum DrmCommitOpt opt; uint32_t device_id, prop_id; uint64_t value; } commit;
+
+int drm_opt_commit (enum DrmCommitOpt opt, void *data, uint32_t device_id, uint32_t prop_id, uint64_t value) {
+  commit.calls++;
+  commit.opt = opt;
+  commit.device_id = device_id;
+  commit.prop_id = prop_id;
+  commit.value = value;
+  return commit.calls;
+}
+
+static void set_range_desc (uint8_t *edid, int slot, uint8_t offsets, uint8_t min_hz, uint8_t max_hz) {
+  uint8_t *desc = &edid[54 + slot * 18];
+  memset(desc, 0, 18);
+  desc[3] = 0xFD;
+  desc[4] = offsets;
+  desc[5] = min_hz;
+  desc[6] = max_hz;
+}
+
+static void test_parse_range () {
+  uint8_t edid[128] = { 0 };
+  uint32_t min_hz = 0, max_hz = 0;
+
+  // detailed timing in the first slot, the range limits in the third
+  edid[54] = 0x02;
+  edid[55] = 0x3A;
+  set_range_desc(edid, 2, 0, 48, 144);
+  CHECK(drm_parse_vrr_range(edid, sizeof(edid), &min_hz, &max_hz));
+  CHECK(min_hz == 48 && max_hz == 144);
+
+  set_range_desc(edid, 2, 0x02, 48, 105);
+  CHECK(drm_parse_vrr_range(edid, sizeof(edid), &min_hz, &max_hz));
+  CHECK(min_hz == 48 && max_hz == 360);
+
+  set_range_desc(edid, 2, 0x03, 5, 245);
+  CHECK(drm_parse_vrr_range(edid, sizeof(edid), &min_hz, &max_hz));
+  CHECK(min_hz == 260 && max_hz == 500);
+
+  set_range_desc(edid, 3, 0, 40, 60);
+  memset(&edid[54 + 2 * 18], 0, 18);
+  CHECK(drm_parse_vrr_range(edid, sizeof(edid), &min_hz, &max_hz));
+  CHECK(min_hz == 40 && max_hz == 60);
+}
+
+static void test_parse_no_range () {
+  uint8_t edid[128] = { 0 };
+  uint32_t min_hz = 1, max_hz = 2;
+
+  // product name descriptor only
+  edid[54 + 3] = 0xFC;
+  CHECK(!drm_parse_vrr_range(edid, sizeof(edid), &min_hz, &max_hz));
+  CHECK(min_hz == 1 && max_hz == 2);
+
+  set_range_desc(edid, 0, 0, 48, 144);
+  CHECK(!drm_parse_vrr_range(edid, 127, &min_hz, &max_hz));
+  CHECK(!drm_parse_vrr_range(NULL, 0, &min_hz, &max_hz));
+  CHECK(min_hz == 1 && max_hz == 2);
+}
+
+static void test_queue_vrr () {
+  memset(&commit, 0, sizeof(commit));
+  CHECK(drm_queue_vrr(41, 27, true) > 0);
+  CHECK(commit.calls == 1);
+  CHECK(commit.opt == DRM_ADD_COMMIT);
+  CHECK(commit.device_id == 41 && commit.prop_id == 27 && commit.value == 1);
+
+  CHECK(drm_queue_vrr(41, 27, false) > 0);
+  CHECK(commit.value == 0);
+
+  memset(&commit, 0, sizeof(commit));
+  CHECK(drm_queue_vrr(41, 0, true) < 0);
+  CHECK(drm_queue_vrr(0, 27, true) < 0);
+  CHECK(commit.calls == 0);
+}
+
+int main () {
+  test_parse_range();
+  test_parse_no_range();
+  test_queue_vrr();
+
+  return failures == 0 ? 0 : 1;
+}